@@ -0,0 +1,238 @@
+#include <cpputil.hpp>
+#include <nndescent.hpp>
+#include <map>
+
+using namespace std;
+using namespace cpputil;
+using namespace nndescent;
+
+// usage: aknng_bench [--data path.fvecs|.fbin|...] [--n 100000] [--dim 128]
+//                    [--gt knn.ivecs] [--sample 1000] [--K 10,20]
+//                    [--rho 0.5,1] [--threads 1,8] [--init random,rp_forest]
+//                    [--out bench.jsonl]
+// without --data a clustered synthetic dataset is generated. without --gt
+// the exact neighbors of --sample nodes are found by brute force. one json
+// line per run goes to --out and to stdout.
+
+// l2 counting its evaluations in per-thread slots a cache line apart
+struct CountingL2 : metric::L2 {
+    static constexpr int stride = 8;
+    static inline vector<long long> counts;
+
+    template <typename T>
+    static float distance(const T* x, const T* y, size_t dim) {
+        ++counts[omp_get_thread_num() * stride];
+        return metric::L2::distance(x, y, dim);
+    }
+
+    template <typename T>
+    static void distances(const T* x, const T* const* ys, size_t m, size_t dim,
+                          float* out) {
+        counts[omp_get_thread_num() * stride] += m;
+        metric::L2::distances(x, ys, m, dim, out);
+    }
+
+    static auto reset(int n_threads) { counts.assign(n_threads * stride, 0); }
+
+    static auto total() {
+        long long result = 0;
+        for (size_t i = 0; i < counts.size(); i += stride) result += counts[i];
+        return result;
+    }
+};
+
+auto parse_args(int argc, char** argv) {
+    map<string, string> args;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const string key = argv[i];
+        if (key.rfind("--", 0) != 0)
+            throw runtime_error("invalid argument: " + key);
+        args[key.substr(2)] = argv[i + 1];
+    }
+    return args;
+}
+
+template <typename T>
+auto parse_list(const string& text) {
+    vector<T> result;
+    istringstream stream(text);
+    string field;
+    while (getline(stream, field, ',')) {
+        if constexpr (is_same_v<T, string>) result.push_back(field);
+        else result.push_back(static_cast<T>(stod(field)));
+    }
+    return result;
+}
+
+// gaussian clusters written as .fbin: <n: uint32> <dim: uint32> <rows>
+auto write_synthetic(const string& path, int n, int dim, int n_clusters,
+                     uint64_t seed) {
+    vector<float> centers(static_cast<size_t>(n_clusters) * dim);
+    auto engine = CounterRNG(seed, 0, 0);
+    normal_distribution<float> center_dist(0, 10);
+    for (auto& x : centers) x = center_dist(engine);
+
+    vector<float> rows(static_cast<size_t>(n) * dim);
+#pragma omp parallel for
+    for (int i = 0; i < n; ++i) {
+        auto row_engine = CounterRNG(seed, 1, i);
+        normal_distribution<float> dist(0, 1);
+        const auto center = &centers[(row_engine() % n_clusters) * dim];
+        for (int j = 0; j < dim; ++j) {
+            rows[static_cast<size_t>(i) * dim + j] = center[j] + dist(row_engine);
+        }
+    }
+
+    ofstream ofs(path, ios::binary);
+    const uint32_t header[2] = {uint32_t(n), uint32_t(dim)};
+    ofs.write((char*)header, sizeof(header));
+    ofs.write((char*)rows.data(), rows.size() * sizeof(float));
+    if (!ofs)
+        throw runtime_error("can't write file: " + path);
+}
+
+// peak resident set size of this process in kB since the last reset
+auto reset_peak_rss() {
+    ofstream ofs("/proc/self/clear_refs");
+    ofs << "5";
+}
+
+auto peak_rss_kb() {
+    ifstream ifs("/proc/self/status");
+    string line;
+    while (getline(ifs, line)) {
+        if (line.rfind("VmHWM:", 0) == 0) return stol(line.substr(6));
+    }
+    return 0l;
+}
+
+// exact neighbors of the sampled nodes, excluding the node itself
+auto brute_force(DataArray<float>& dataset, const vector<int>& samples, int k) {
+    vector<vector<int>> result(samples.size());
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < samples.size(); ++i) {
+        Neighbors neighbors;
+        for (int id = 0; id < dataset.n; ++id) {
+            if (id == samples[i]) continue;
+            neighbors.emplace_back(metric::L2::distance(
+                    dataset.find(samples[i]), dataset.find(id), dataset.dim), id);
+        }
+        partial_sort(neighbors.begin(), neighbors.begin() + k, neighbors.end(),
+                     [](const Neighbor& a, const Neighbor& b) {
+                         return a.dist < b.dist;
+                     });
+        for (int j = 0; j < k; ++j) result[i].emplace_back(neighbors[j].id);
+    }
+    return result;
+}
+
+// first rows of a k-nn ground truth of the dataset itself, without self
+auto read_ground_truth(const string& path, int n_samples, int k) {
+    ifstream ifs(path, ios::binary);
+    int gt_k = 0;
+    ifs.read((char*)&gt_k, sizeof(int));
+    if (!ifs)
+        throw runtime_error("can't open file: " + path);
+
+    GroundTruth gt(n_samples, gt_k);
+    gt.load(path);
+    vector<vector<int>> result(n_samples);
+    for (int i = 0; i < n_samples; ++i) {
+        for (const auto id : gt[i]) {
+            if (id != i && result[i].size() < k) result[i].emplace_back(id);
+        }
+        if (result[i].size() < k)
+            throw runtime_error("ground truth has fewer than K neighbors");
+    }
+    return result;
+}
+
+int main(int argc, char** argv) {
+    auto args = parse_args(argc, argv);
+    const auto get = [&](const string& key, const string& value) {
+        return args.count(key) ? args[key] : value;
+    };
+
+    int n = stoi(get("n", "100000")), dim = stoi(get("dim", "128"));
+    string data_path = get("data", "");
+    if (data_path.empty()) {
+        data_path = "/tmp/aknng_bench_" + to_string(n) + "x" + to_string(dim) + ".fbin";
+        write_synthetic(data_path, n, dim, 100, 42);
+    }
+
+    const auto Ks = parse_list<int>(get("K", "20"));
+    const auto rhos = parse_list<float>(get("rho", "1"));
+    const auto threads = parse_list<int>(get("threads", to_string(n_max_threads)));
+    const auto inits = parse_list<string>(get("init", "random"));
+    const auto max_K = *max_element(Ks.begin(), Ks.end());
+    const auto max_threads = *max_element(threads.begin(), threads.end());
+
+    // exact neighbors of the sample, for the largest K
+    const int n_samples = min(n, stoi(get("sample", "1000")));
+    vector<int> samples(n_samples);
+    vector<vector<int>> expect;
+    if (args.count("gt")) {
+        iota(samples.begin(), samples.end(), 0);
+        expect = read_ground_truth(args["gt"], n_samples, max_K);
+    } else {
+        for (int i = 0; i < n_samples; ++i) {
+            samples[i] = static_cast<int>(static_cast<long long>(n) * i / n_samples);
+        }
+        DataArray<float> dataset(n, dim);
+        dataset.load(data_path);
+        expect = brute_force(dataset, samples, max_K);
+    }
+
+    ofstream ofs(get("out", "bench.jsonl"));
+    for (const auto K : Ks) {
+        for (const auto rho : rhos) {
+            for (const auto n_threads : threads) {
+                for (const auto& init : inits) {
+                    BuildParams params;
+                    params.rho = rho;
+                    params.verbose = false;
+                    if (init == "rp_forest") params.init_mode = InitMode::rp_forest;
+                    else if (init != "random")
+                        throw runtime_error("invalid init: " + init);
+
+                    omp_set_num_threads(n_threads);
+                    CountingL2::reset(max(max_threads, n_max_threads));
+                    reset_peak_rss();
+
+                    const auto start = get_now();
+                    AKNNG<CountingL2> aknng(n, dim, K);
+                    aknng.build(data_path, params);
+                    const auto build_seconds = get_duration(start, get_now()) / 1e6;
+                    const auto n_distances = CountingL2::total();
+
+                    float recall = 0;
+                    for (int i = 0; i < n_samples; ++i) {
+                        Neighbors actual;
+                        for (const auto& neighbor : aknng.edgeset[samples[i]]) {
+                            actual.emplace_back(neighbor.dist, neighbor.id);
+                        }
+                        recall += calc_recall(actual, expect[i], K);
+                    }
+
+                    json result;
+                    result["data"] = data_path;
+                    result["n"] = n;
+                    result["dim"] = dim;
+                    result["K"] = K;
+                    result["rho"] = rho;
+                    result["threads"] = n_threads;
+                    result["init"] = init;
+                    result["build_seconds"] = build_seconds;
+                    result["iterations"] = aknng.n_iterations;
+                    result["stop"] = stop_reason_name(aknng.stop_reason);
+                    result["distance_evaluations"] = n_distances;
+                    result["peak_rss_kb"] = peak_rss_kb();
+                    result["recall"] = recall / n_samples;
+                    result["n_samples"] = n_samples;
+                    ofs << result.dump() << endl;
+                    cout << result.dump() << endl;
+                }
+            }
+        }
+    }
+}
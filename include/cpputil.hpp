@@ -12,7 +12,17 @@
 #include <chrono>
 #include <exception>
 #include <stdexcept>
+#include <memory>
+#include <cstdint>
+#include <type_traits>
+#include <cstring>
+#include <charconv>
+#include <cassert>
 #include <omp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <x86intrin.h>
 #include <json.hpp>
 
@@ -225,58 +235,6 @@ namespace cpputil {
         return result;
     }
 
-    template <typename T = float>
-    Dataset<T> read_csv(const std::string &path, const int& nrows = -1,
-                        const bool &skip_header = false) {
-        std::ifstream ifs(path);
-        if (!ifs) throw runtime_error("Can't open file!");
-        std::string line;
-
-        Dataset<T> series;
-        for (size_t i = 0; (i < nrows) && std::getline(ifs, line); ++i) {
-            // if first line is the header then skip
-            if (skip_header && (i == 0)) continue;
-            std::vector<T> v = split<T>(line);
-            series.push_back(Data<T>(i, v));
-        }
-        return series;
-    }
-
-    const int n_max_threads = omp_get_max_threads();
-
-    template <typename T = float>
-    Dataset<T> load_data(const string& path, int n = 0) {
-        // file path
-        if (path.rfind(".csv", path.size()) < path.size()) {
-            auto series = Dataset<T>();
-            ifstream ifs(path);
-            if (!ifs) throw runtime_error("Can't open file!");
-            string line;
-            for (size_t i = 0; (i < n) && std::getline(ifs, line); ++i) {
-                auto v = split(line);
-                series.push_back(Data<T>(i, v));
-            }
-            return series;
-        }
-
-        // dir path
-        auto series = Dataset<T>(n * 1000);
-#pragma omp parallel for
-        for (int i = 0; i < n; i++) {
-            const string data_path = path + '/' + to_string(i) + ".csv";
-            ifstream ifs(data_path);
-            if (!ifs) throw runtime_error("Can't open file!");
-            string line;
-            while(getline(ifs, line)) {
-                auto v = split(line);
-                const auto id = static_cast<size_t>(v[0]);
-                v.erase(v.begin());
-                series[id] = Data<T>(id, v);
-            }
-        }
-        return series;
-    }
-
     template<typename T>
     void write_csv(const std::vector<T> &v, const std::string &path) {
         std::ofstream ofs(path);
@@ -457,22 +415,443 @@ namespace cpputil {
         return neighbors_list;
     }
 
+    // splitmix64 finalizer
+    inline uint64_t mix64(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+    // counter-based generator: the i-th number of stream (seed, stream, id)
+    // is a pure function of those values and i, so every node or block can
+    // own an independent stream regardless of which thread draws from it
+    struct CounterRNG {
+        using result_type = uint64_t;
+
+        uint64_t key;
+        uint64_t counter = 0;
+
+        CounterRNG(uint64_t seed, uint64_t stream, uint64_t id) :
+                key(mix64(mix64(mix64(seed) ^ stream) ^ id)) {}
+
+        static constexpr result_type min() { return 0; }
+        static constexpr result_type max() { return UINT64_MAX; }
+
+        result_type operator()() {
+            return mix64(key + 0x9e3779b97f4a7c15ull * ++counter);
+        }
+    };
+
+    // owner of an mmap'd range, unmapped with the last reference
+    struct MappedRegion {
+        void* addr;
+        size_t size;
+
+        MappedRegion(void* addr, size_t size) : addr(addr), size(size) {}
+        MappedRegion(const MappedRegion&) = delete;
+        MappedRegion& operator=(const MappedRegion&) = delete;
+        ~MappedRegion() { munmap(addr, size); }
+
+        auto begin() const { return static_cast<char*>(addr); }
+    };
+
+    // private (copy-on-write) mapping of a whole file
+    auto map_file(const string& path) {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw runtime_error("can't open file: " + path);
+
+        struct stat st{};
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw runtime_error("can't stat file: " + path);
+        }
+        const auto size = static_cast<size_t>(st.st_size);
+        void* addr = size == 0 ? MAP_FAILED :
+                     mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                          fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED)
+            throw runtime_error("can't map file: " + path);
+
+        return make_shared<MappedRegion>(addr, size);
+    }
+
+    // page-backed anonymous memory, optionally backed by huge pages
+    auto map_anonymous(size_t size, bool use_hugepages = false) {
+        void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED)
+            throw runtime_error("can't allocate " + to_string(size) + " bytes");
+#ifdef MADV_HUGEPAGE
+        if (use_hugepages) madvise(addr, size, MADV_HUGEPAGE);
+#endif
+        return make_shared<MappedRegion>(addr, size);
+    }
+
+    const int n_max_threads = omp_get_max_threads();
+
+    // parses the delimited numbers of [first, last) into fields
+    template <typename T = float>
+    void parse_fields(const char* first, const char* last, vector<T>& fields,
+                      char delimiter = ',') {
+        fields.clear();
+        while (first < last) {
+            while (first < last && *first == ' ') ++first;
+            conditional_t<is_integral_v<T>, long long, double> value;
+            const auto [ptr, error] = from_chars(first, last, value);
+            if (error != errc())
+                throw runtime_error("invalid number: " + string(first, last));
+            fields.push_back(static_cast<T>(value));
+            first = ptr;
+            while (first < last && *first == ' ') ++first;
+            if (first < last && *first++ != delimiter)
+                throw runtime_error("invalid delimiter: " + string(first - 1, last));
+        }
+    }
+
+    // appends value in its shortest round-trip form
+    template <typename T>
+    void append_number(string& buffer, T value) {
+        char digits[32];
+        const auto result = to_chars(digits, digits + sizeof(digits), value);
+        buffer.append(digits, result.ptr);
+    }
+
+    // first position after n_lines lines of [first, last)
+    inline const char* skip_lines(const char* first, const char* last,
+                                  size_t n_lines) {
+        for (size_t i = 0; i < n_lines && first < last; ++i) {
+            const auto eol = static_cast<const char*>(memchr(first, '\n', last - first));
+            first = eol ? eol + 1 : last;
+        }
+        return first;
+    }
+
+    // calls parse_line(first, last, chunk) for every line of the file, in
+    // parallel over chunks of whole lines, and returns the chunks in file
+    // order. only lines [n_skipped, max_lines) are parsed, max_lines = 0 for
+    // all lines.
+    template <typename Chunk, typename ParseLine>
+    auto parse_lines(const string& path, const ParseLine& parse_line,
+                     size_t max_lines = 0, size_t n_skipped = 0) {
+        struct stat st{};
+        if (stat(path.c_str(), &st) != 0)
+            throw runtime_error("Can't open file!: " + path);
+        if (st.st_size == 0) return vector<Chunk>();
+
+        const auto file = map_file(path);
+        const char* first = file->begin();
+        const char* last = first + file->size;
+        if (max_lines > 0) last = skip_lines(first, last, max_lines);
+        first = skip_lines(first, last, n_skipped);
+
+        // chunk boundaries moved forward to the next line break
+        const size_t n_chunks = n_max_threads * 4;
+        vector<const char*> bounds{first};
+        for (size_t i = 1; i < n_chunks; ++i) {
+            auto it = max(bounds.back(), first + (last - first) * i / n_chunks);
+            if (it > first && it[-1] != '\n') it = skip_lines(it, last, 1);
+            bounds.emplace_back(it);
+        }
+        bounds.emplace_back(last);
+
+        vector<Chunk> chunks(n_chunks);
+        string error;
+#pragma omp parallel for schedule(dynamic, 1)
+        for (size_t i = 0; i < n_chunks; ++i) {
+            try {
+                for (auto it = bounds[i]; it < bounds[i + 1];) {
+                    auto eol = static_cast<const char*>(
+                            memchr(it, '\n', bounds[i + 1] - it));
+                    if (!eol) eol = bounds[i + 1];
+                    auto line_end = eol;
+                    if (line_end > it && line_end[-1] == '\r') --line_end;
+                    parse_line(it, line_end, chunks[i]);
+                    it = eol + 1;
+                }
+            } catch (const exception& e) {
+#pragma omp critical
+                error = e.what();
+            }
+        }
+        if (!error.empty()) throw runtime_error(error);
+        return chunks;
+    }
+
+    // rows parsed in parallel, numbered by line
+    template <typename T = float>
+    auto read_rows(const string& path, size_t max_lines = 0,
+                   size_t n_skipped = 0) {
+        const auto chunks = parse_lines<vector<vector<T>>>(
+                path, [](const char* first, const char* last,
+                         vector<vector<T>>& rows) {
+                    rows.emplace_back();
+                    parse_fields(first, last, rows.back());
+                }, max_lines, n_skipped);
+        Dataset<T> series;
+        for (const auto& rows : chunks) {
+            for (const auto& row : rows) {
+                series.emplace_back(n_skipped + series.size(), row);
+            }
+        }
+        return series;
+    }
+
+    template <typename T = float>
+    Dataset<T> read_csv(const std::string &path, const int& nrows = -1,
+                        const bool &skip_header = false) {
+        if (nrows == 0) return Dataset<T>();
+        // the header counts as line 0
+        return read_rows<T>(path, nrows > 0 ? nrows : 0, skip_header ? 1 : 0);
+    }
+
+    template <typename T = float>
+    Dataset<T> load_data(const string& path, int n = 0) {
+        // file path
+        if (path.rfind(".csv", path.size()) < path.size()) {
+            if (n <= 0) return Dataset<T>();
+            return read_rows<T>(path, n);
+        }
+
+        // dir path: rows of <id>,<x_1>,... in <i>.csv, blank lines skipped
+        auto series = Dataset<T>(n * 1000);
+        string error;
+#pragma omp parallel for
+        for (int i = 0; i < n; i++) {
+            try {
+                const auto chunks = parse_lines<vector<vector<T>>>(
+                        path + '/' + to_string(i) + ".csv",
+                        [](const char* first, const char* last,
+                           vector<vector<T>>& rows) {
+                            rows.emplace_back();
+                            parse_fields(first, last, rows.back());
+                            if (rows.back().empty()) rows.pop_back();
+                        });
+                for (const auto& rows : chunks) {
+                    for (const auto& row : rows) {
+                        const auto id = static_cast<size_t>(row[0]);
+                        if (static_cast<double>(row[0]) < 0 || id >= series.size())
+                            throw runtime_error("id out of range: " + to_string(row[0]));
+                        series[id] = Data<T>(id, vector<T>(row.begin() + 1, row.end()));
+                    }
+                }
+            } catch (const exception& e) {
+#pragma omp critical
+                error = e.what();
+            }
+        }
+        if (!error.empty()) throw runtime_error(error);
+        return series;
+    }
+
+    inline float half_to_float(uint16_t half) {
+        const uint32_t sign = (half & 0x8000u) << 16;
+        uint32_t exponent = (half >> 10) & 0x1fu;
+        uint32_t mantissa = half & 0x3ffu;
+        uint32_t bits;
+        if (exponent == 0x1f) {
+            bits = sign | 0x7f800000u | (mantissa << 13);
+        } else if (exponent != 0) {
+            bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+        } else if (mantissa == 0) {
+            bits = sign;
+        } else {
+            // subnormal: shift the leading one into the implicit bit
+            exponent = 113;
+            for (; !(mantissa & 0x400u); mantissa <<= 1) --exponent;
+            bits = sign | (exponent << 23) | ((mantissa & 0x3ffu) << 13);
+        }
+        float value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    // round to nearest even
+    inline uint16_t float_to_half(float value) {
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        const uint32_t sign = (bits >> 16) & 0x8000u;
+        const uint32_t abs_bits = bits & 0x7fffffffu;
+
+        if (abs_bits > 0x7f800000u) return sign | 0x7e00u;
+        if (abs_bits >= 0x47800000u) return sign | 0x7c00u;
+        if (abs_bits < 0x33000000u) return sign;
+
+        uint32_t half, rest, tie;
+        if (abs_bits < 0x38800000u) {
+            const uint32_t shift = 126 - (abs_bits >> 23);
+            const uint32_t mantissa = (abs_bits & 0x7fffffu) | 0x800000u;
+            half = mantissa >> shift;
+            rest = mantissa & ((1u << shift) - 1);
+            tie = 1u << (shift - 1);
+        } else {
+            half = (abs_bits - 0x38000000u) >> 13;
+            rest = abs_bits & 0x1fffu;
+            tie = 0x1000u;
+        }
+        if (rest > tie || (rest == tie && (half & 1))) ++half;
+        return sign | half;
+    }
+
+    // IEEE half precision storage
+    struct float16 {
+        uint16_t bits;
+
+        float16() : bits(0) {}
+        float16(float value) : bits(float_to_half(value)) {}
+
+        operator float() const { return half_to_float(bits); }
+    };
+
+    // upper half of a float
+    struct bfloat16 {
+        uint16_t bits;
+
+        bfloat16() : bits(0) {}
+        bfloat16(float value) {
+            uint32_t x;
+            memcpy(&x, &value, sizeof(x));
+            if ((x & 0x7fffffffu) > 0x7f800000u)
+                bits = (x >> 16) | 0x40u;
+            else
+                bits = (x + 0x7fffu + ((x >> 16) & 1)) >> 16;
+        }
+
+        operator float() const {
+            const uint32_t x = uint32_t(bits) << 16;
+            float value;
+            memcpy(&value, &x, sizeof(value));
+            return value;
+        }
+    };
+
+    // element type tag of file headers
+    template <typename T>
+    constexpr uint32_t element_code() {
+        if constexpr (is_same_v<T, float>) return 0;
+        else if constexpr (is_same_v<T, float16>) return 1;
+        else if constexpr (is_same_v<T, bfloat16>) return 2;
+        else if constexpr (is_same_v<T, int8_t>) return 3;
+        else if constexpr (is_same_v<T, uint8_t>) return 4;
+        else static_assert(!sizeof(T), "unsupported element type");
+    }
+
+    // 64-bit checksum of size bytes, a word at a time
+    inline uint64_t checksum64(const char* data, size_t size) {
+        uint64_t hash = size;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8) {
+            uint64_t word;
+            memcpy(&word, data + i, sizeof(word));
+            hash = mix64(hash ^ word);
+        }
+        uint64_t tail = 0;
+        memcpy(&tail, data + i, size - i);
+        return mix64(hash ^ tail);
+    }
+
+    template <typename T, typename S>
+    T element_cast(S value) {
+        if constexpr (is_same_v<T, S>) return value;
+        else return T(static_cast<float>(value));
+    }
+
+    // n x dim rows of float, float16, bfloat16, int8 or uint8 elements
+    template <typename T = float>
     struct DataArray {
-        vector<float> x;
+        vector<T> x;
         int n, dim;
+        // map files instead of reading them through a stream
+        bool use_mmap = true;
+        // ask for transparent huge pages on anonymous buffers
+        bool use_hugepages = false;
+        // first row of the file to load, for loading one shard of it
+        size_t offset = 0;
+        // rows living in a mapping instead of x
+        shared_ptr<MappedRegion> region;
+        T* mapped = nullptr;
+
+        using Element = T;
+        using Data = const T*;
+
+        // zeroed rows in an anonymous mapping, whose pages are only
+        // backed once written, so a dataset loaded afterwards is never
+        // held twice
+        DataArray(int n, int dim): n(n), dim(dim) {
+            if (size() == 0) return;
+            region = map_anonymous(size() * sizeof(T));
+            mapped = reinterpret_cast<T*>(region->begin());
+        }
+
+        // a copy holds its rows in x, so neither side writes through the
+        // mapping of the other
+        DataArray(const DataArray& other) :
+                n(other.n), dim(other.dim), use_mmap(other.use_mmap),
+                use_hugepages(other.use_hugepages), offset(other.offset) {
+            const auto rows = other.mapped ? other.mapped : other.x.data();
+            x.assign(rows, rows + size());
+        }
+
+        DataArray(DataArray&& other) noexcept :
+                x(move(other.x)), n(other.n), dim(other.dim),
+                use_mmap(other.use_mmap), use_hugepages(other.use_hugepages),
+                offset(other.offset), region(move(other.region)),
+                mapped(exchange(other.mapped, nullptr)) {}
 
-        using Data = vector<float>::const_iterator;
+        DataArray& operator=(const DataArray& other) {
+            if (this != &other) *this = DataArray(other);
+            return *this;
+        }
+
+        DataArray& operator=(DataArray&& other) noexcept {
+            x = move(other.x);
+            n = other.n;
+            dim = other.dim;
+            use_mmap = other.use_mmap;
+            use_hugepages = other.use_hugepages;
+            offset = other.offset;
+            region = move(other.region);
+            mapped = exchange(other.mapped, nullptr);
+            return *this;
+        }
 
-        DataArray(int n, int dim): n(n), dim(dim), x(n * dim) {}
+        auto size() const { return static_cast<size_t>(n) * dim; }
 
-        auto load(const vector<float>& v) { x = v; }
+        T* data() {
+            if (mapped) return mapped;
+            assert(x.size() == size());
+            return x.data();
+        }
+
+        auto load(const vector<T>& v) {
+            if (v.size() != size())
+                throw runtime_error("data size not matched");
+            x = v;
+            region.reset();
+            mapped = nullptr;
+        }
 
-        auto load_fvecs(const string& path) {
-            float* row = new float[dim];
+        // takes the rows without a copy
+        auto load(vector<T>&& v) {
+            if (v.size() != size())
+                throw runtime_error("data size not matched");
+            x = move(v);
+            region.reset();
+            mapped = nullptr;
+        }
+
+        template <typename S>
+        auto load_vecs_stream(const string& path) {
             ifstream ifs(path, ios::binary);
             if (!ifs)
                 throw runtime_error("can't open file: " + path);
 
+            ifs.seekg(offset * (sizeof(int) + dim * sizeof(S)));
+            x.resize(size());
+            region.reset();
+            mapped = nullptr;
+            vector<S> row(dim);
             for (int i = 0; i < n; i++) {
                 int head = 0;
                 ifs.read((char*)&head, 4);
@@ -480,37 +859,206 @@ namespace cpputil {
                 if (head != dim)
                     throw runtime_error("dimension not matched");
 
-                ifs.read((char*)row, head * sizeof(float));
-                for (int j = 0; j < dim; j++) {
-                    x[i * dim + j] = row[j];
+                ifs.read((char*)row.data(), head * sizeof(S));
+                transform(row.begin(), row.end(),
+                          x.begin() + static_cast<size_t>(i) * dim,
+                          element_cast<T, S>);
+            }
+            if (!ifs)
+                throw runtime_error("too few rows: " + path);
+        }
+
+        // <dim: int32> <dim elements of S> per row. the per-row header
+        // breaks alignment, so the mapped file is repacked in parallel into
+        // a page-backed buffer once
+        template <typename S>
+        auto load_vecs(const string& path) {
+            if (!use_mmap) return load_vecs_stream<S>(path);
+
+            const auto file = map_file(path);
+            const size_t row_size = sizeof(int) + dim * sizeof(S);
+            if (file->size < row_size * (offset + n))
+                throw runtime_error("too few rows: " + path);
+            madvise(file->addr, file->size, MADV_SEQUENTIAL);
+
+            auto buffer = map_anonymous(size() * sizeof(T), use_hugepages);
+            auto rows = reinterpret_cast<T*>(buffer->begin());
+
+            bool matched = true;
+#pragma omp parallel for reduction(&&:matched)
+            for (int i = 0; i < n; i++) {
+                const auto row = file->begin() + row_size * (offset + i);
+                int head;
+                memcpy(&head, row, sizeof(int));
+                matched = matched && head == dim;
+
+                auto dest = rows + static_cast<size_t>(i) * dim;
+                if constexpr (is_same_v<T, S>) {
+                    memcpy(dest, row + sizeof(int), dim * sizeof(T));
+                } else {
+                    for (int j = 0; j < dim; j++) {
+                        S value;
+                        memcpy(&value, row + sizeof(int) + j * sizeof(S),
+                               sizeof(S));
+                        dest[j] = element_cast<T, S>(value);
+                    }
+                }
+            }
+            if (!matched)
+                throw runtime_error("dimension not matched");
+
+            x.clear();
+            x.shrink_to_fit();
+            region = buffer;
+            mapped = rows;
+        }
+
+        // header <n: uint32> <dim: uint32>, then n * dim elements of S: the
+        // rows are used in place when S is the element type
+        template <typename S>
+        auto load_bin(const string& path) {
+            const auto file = map_file(path);
+            uint32_t header[2] = {0, 0};
+            if (file->size >= sizeof(header))
+                memcpy(header, file->begin(), sizeof(header));
+
+            if (header[1] != dim)
+                throw runtime_error("dimension not matched");
+            if (header[0] < offset + n ||
+                file->size < sizeof(header) + (offset * dim + size()) * sizeof(S))
+                throw runtime_error("too few rows: " + path);
+
+            const auto rows = reinterpret_cast<S*>(file->begin() + sizeof(header)) +
+                              offset * dim;
+            if constexpr (is_same_v<T, S>) {
+                if (use_mmap) {
+                    madvise(file->addr, file->size, MADV_WILLNEED);
+                    x.clear();
+                    x.shrink_to_fit();
+                    region = file;
+                    mapped = rows;
+                    return;
                 }
             }
+
+            x.resize(size());
+#pragma omp parallel for
+            for (int i = 0; i < n; i++) {
+                const auto first = static_cast<size_t>(i) * dim;
+                transform(rows + first, rows + first + dim, x.begin() + first,
+                          element_cast<T, S>);
+            }
+            region.reset();
+            mapped = nullptr;
         }
 
         auto load(const string& path) {
             if (ends_with(".fvecs", path))
-                load_fvecs(path);
+                load_vecs<float>(path);
+            else if (ends_with(".bvecs", path))
+                load_vecs<uint8_t>(path);
+            else if (ends_with(".fbin", path))
+                load_bin<float>(path);
+            else if (ends_with(".u8bin", path))
+                load_bin<uint8_t>(path);
+            else if (ends_with(".i8bin", path))
+                load_bin<int8_t>(path);
             else
                 throw runtime_error("invalid file type");
         }
 
-        decltype(auto) operator[](int i) { return x[i]; }
+        // appends n_rows rows. mapped rows are copied into x first, after
+        // which appends are amortized by the vector's growth.
+        auto append(const T* rows, int n_rows) {
+            if (mapped) {
+                x.assign(mapped, mapped + size());
+                region.reset();
+                mapped = nullptr;
+            }
+            x.insert(x.end(), rows, rows + static_cast<size_t>(n_rows) * dim);
+            n += n_rows;
+        }
+
+        // scale every row to unit l2 norm
+        auto normalize() {
+            if (is_integral_v<T>)
+                throw runtime_error("can't normalize integer rows");
+
+#pragma omp parallel for
+            for (int i = 0; i < n; i++) {
+                const auto row = find(i);
+                float norm = 0;
+                for (int j = 0; j < dim; j++) {
+                    norm += static_cast<float>(row[j]) * static_cast<float>(row[j]);
+                }
+                norm = sqrt(norm);
+                if (norm <= 0) continue;
+                for (int j = 0; j < dim; j++) {
+                    row[j] = element_cast<T, float>(static_cast<float>(row[j]) / norm);
+                }
+            }
+        }
+
+        T& operator[](size_t i) { return data()[i]; }
 
-        decltype(auto) find(int i) {
-            return next(x.begin(), i * dim);
+        T* find(int i) {
+            return data() + static_cast<size_t>(i) * dim;
         }
     };
 
-    auto euclidean_distance(DataArray::Data data_1, DataArray::Data data_2,
-                            int dim) {
+    template <typename T>
+    auto euclidean_distance(const T* data_1, const T* data_2, int dim) {
         float result = 0;
         for (size_t i = 0; i < dim; i++, ++data_1, ++data_2) {
-            result += pow(*data_1 - *data_2, 2);
+            result += pow(static_cast<float>(*data_1) -
+                          static_cast<float>(*data_2), 2);
         }
         result = sqrt(result);
         return result;
     }
 
+    // rows flagged in excluded, if given, are left out
+    template <typename T>
+    auto calc_centroid(DataArray<T>& dataset, const vector<char>& excluded = {}) {
+        vector<double> centroid(dataset.dim, 0);
+        int n_rows = 0;
+        for (int i = 0; i < dataset.n; ++i) {
+            if (!excluded.empty() && excluded[i]) continue;
+            const auto data = dataset.find(i);
+            for (int j = 0; j < dataset.dim; ++j) {
+                centroid[j] += static_cast<float>(data[j]);
+            }
+            ++n_rows;
+        }
+
+        vector<float> result(dataset.dim);
+        for (int j = 0; j < dataset.dim; ++j) {
+            result[j] = centroid[j] / max(n_rows, 1);
+        }
+        return result;
+    }
+
+    template <typename T>
+    auto calc_medoid(DataArray<T>& dataset, const vector<char>& excluded = {}) {
+        const auto centroid = calc_centroid(dataset, excluded);
+
+        int medoid = 0;
+        auto min_dist = float_max;
+        for (int i = 0; i < dataset.n; ++i) {
+            if (!excluded.empty() && excluded[i]) continue;
+            const auto data = dataset.find(i);
+            float dist = 0;
+            for (int j = 0; j < dataset.dim; ++j) {
+                const auto diff = static_cast<float>(data[j]) - centroid[j];
+                dist += diff * diff;
+            }
+            if (dist >= min_dist) continue;
+            min_dist = dist;
+            medoid = i;
+        }
+        return medoid;
+    }
+
     struct GroundTruth {
         int n, k;
         vector<vector<int>> x;
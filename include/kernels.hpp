@@ -0,0 +1,718 @@
+//
+// Distance kernels selected once at startup by the instruction sets the
+// running CPU supports, so one binary runs at full speed on every host.
+// Every kernel exists for float, float16, bfloat16, int8 and uint8 rows and
+// reads the narrow types directly instead of widened copies.
+//
+
+#ifndef NNDESCENT_KERNELS_HPP
+#define NNDESCENT_KERNELS_HPP
+
+#include <cpputil.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <stdexcept>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define NNDESCENT_X86
+#include <immintrin.h>
+#endif
+
+using namespace std;
+using namespace cpputil;
+
+namespace kernels {
+    enum class SimdLevel { scalar, avx2, avx512 };
+
+    // 8-bit integer rows are accumulated exactly in int32, which holds
+    // squared distances of up to 33000 dimensions
+    template <typename T>
+    constexpr bool is_byte = is_same_v<T, int8_t> || is_same_v<T, uint8_t>;
+
+    // four independent accumulators to hide the add latency
+    template <typename T>
+    float l2_sqr_scalar(const T* x, const T* y, size_t d) {
+        float sum_0 = 0, sum_1 = 0, sum_2 = 0, sum_3 = 0;
+        size_t i = 0;
+        for (; i + 4 <= d; i += 4) {
+            const float diff_0 = float(x[i]) - float(y[i]);
+            const float diff_1 = float(x[i + 1]) - float(y[i + 1]);
+            const float diff_2 = float(x[i + 2]) - float(y[i + 2]);
+            const float diff_3 = float(x[i + 3]) - float(y[i + 3]);
+            sum_0 += diff_0 * diff_0;
+            sum_1 += diff_1 * diff_1;
+            sum_2 += diff_2 * diff_2;
+            sum_3 += diff_3 * diff_3;
+        }
+        for (; i < d; ++i) {
+            const float diff = float(x[i]) - float(y[i]);
+            sum_0 += diff * diff;
+        }
+        return (sum_0 + sum_1) + (sum_2 + sum_3);
+    }
+
+    template <typename T>
+    float inner_product_scalar(const T* x, const T* y, size_t d) {
+        float sum_0 = 0, sum_1 = 0, sum_2 = 0, sum_3 = 0;
+        size_t i = 0;
+        for (; i + 4 <= d; i += 4) {
+            sum_0 += float(x[i]) * float(y[i]);
+            sum_1 += float(x[i + 1]) * float(y[i + 1]);
+            sum_2 += float(x[i + 2]) * float(y[i + 2]);
+            sum_3 += float(x[i + 3]) * float(y[i + 3]);
+        }
+        for (; i < d; ++i) sum_0 += float(x[i]) * float(y[i]);
+        return (sum_0 + sum_1) + (sum_2 + sum_3);
+    }
+
+    template <typename T>
+    float l1_scalar(const T* x, const T* y, size_t d) {
+        float sum_0 = 0, sum_1 = 0, sum_2 = 0, sum_3 = 0;
+        size_t i = 0;
+        for (; i + 4 <= d; i += 4) {
+            sum_0 += abs(float(x[i]) - float(y[i]));
+            sum_1 += abs(float(x[i + 1]) - float(y[i + 1]));
+            sum_2 += abs(float(x[i + 2]) - float(y[i + 2]));
+            sum_3 += abs(float(x[i + 3]) - float(y[i + 3]));
+        }
+        for (; i < d; ++i) sum_0 += abs(float(x[i]) - float(y[i]));
+        return (sum_0 + sum_1) + (sum_2 + sum_3);
+    }
+
+#ifdef NNDESCENT_X86
+#define NNDESCENT_AVX2 __attribute__((target("avx2,fma,f16c")))
+#define NNDESCENT_AVX512 __attribute__((target("avx512f,avx512bw,avx512vl")))
+
+    // 8 elements of a row as floats
+    NNDESCENT_AVX2 __m256 load_ps_avx2(const float* x) {
+        return _mm256_loadu_ps(x);
+    }
+
+    NNDESCENT_AVX2 __m256 load_ps_avx2(const float16* x) {
+        return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)x));
+    }
+
+    NNDESCENT_AVX2 __m256 load_ps_avx2(const bfloat16* x) {
+        const __m256i bits = _mm256_cvtepu16_epi32(
+                _mm_loadu_si128((const __m128i*)x));
+        return _mm256_castsi256_ps(_mm256_slli_epi32(bits, 16));
+    }
+
+    // 16 elements of a byte row as int16
+    NNDESCENT_AVX2 __m256i load_epi16_avx2(const int8_t* x) {
+        return _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)x));
+    }
+
+    NNDESCENT_AVX2 __m256i load_epi16_avx2(const uint8_t* x) {
+        return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)x));
+    }
+
+    NNDESCENT_AVX2 float reduce_add_avx2(__m256 v) {
+        __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v),
+                                _mm256_extractf128_ps(v, 1));
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+        return _mm_cvtss_f32(sum);
+    }
+
+    NNDESCENT_AVX2 int32_t reduce_add_avx2(__m256i v) {
+        __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v),
+                                    _mm256_extracti128_si256(v, 1));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+        return _mm_cvtsi128_si32(sum);
+    }
+
+    // 32 elements per step covers dims like 96, 128 and 960 without a tail
+    template <typename T>
+    NNDESCENT_AVX2 float l2_sqr_avx2(const T* x, const T* y, size_t d) {
+        if constexpr (is_byte<T>) {
+            __m256i sum_0 = _mm256_setzero_si256();
+            __m256i sum_1 = _mm256_setzero_si256();
+            size_t i = 0;
+            for (; i + 32 <= d; i += 32) {
+                const __m256i diff_0 = _mm256_sub_epi16(load_epi16_avx2(x + i),
+                                                        load_epi16_avx2(y + i));
+                const __m256i diff_1 = _mm256_sub_epi16(
+                        load_epi16_avx2(x + i + 16), load_epi16_avx2(y + i + 16));
+                sum_0 = _mm256_add_epi32(sum_0, _mm256_madd_epi16(diff_0, diff_0));
+                sum_1 = _mm256_add_epi32(sum_1, _mm256_madd_epi16(diff_1, diff_1));
+            }
+            for (; i + 16 <= d; i += 16) {
+                const __m256i diff = _mm256_sub_epi16(load_epi16_avx2(x + i),
+                                                      load_epi16_avx2(y + i));
+                sum_0 = _mm256_add_epi32(sum_0, _mm256_madd_epi16(diff, diff));
+            }
+            int32_t sum = reduce_add_avx2(_mm256_add_epi32(sum_0, sum_1));
+            for (; i < d; ++i) {
+                const int32_t diff = int32_t(x[i]) - int32_t(y[i]);
+                sum += diff * diff;
+            }
+            return float(sum);
+        } else {
+            __m256 sum_0 = _mm256_setzero_ps(), sum_1 = _mm256_setzero_ps();
+            __m256 sum_2 = _mm256_setzero_ps(), sum_3 = _mm256_setzero_ps();
+            size_t i = 0;
+            for (; i + 32 <= d; i += 32) {
+                const __m256 diff_0 = _mm256_sub_ps(load_ps_avx2(x + i),
+                                                    load_ps_avx2(y + i));
+                const __m256 diff_1 = _mm256_sub_ps(load_ps_avx2(x + i + 8),
+                                                    load_ps_avx2(y + i + 8));
+                const __m256 diff_2 = _mm256_sub_ps(load_ps_avx2(x + i + 16),
+                                                    load_ps_avx2(y + i + 16));
+                const __m256 diff_3 = _mm256_sub_ps(load_ps_avx2(x + i + 24),
+                                                    load_ps_avx2(y + i + 24));
+                sum_0 = _mm256_fmadd_ps(diff_0, diff_0, sum_0);
+                sum_1 = _mm256_fmadd_ps(diff_1, diff_1, sum_1);
+                sum_2 = _mm256_fmadd_ps(diff_2, diff_2, sum_2);
+                sum_3 = _mm256_fmadd_ps(diff_3, diff_3, sum_3);
+            }
+            for (; i + 8 <= d; i += 8) {
+                const __m256 diff = _mm256_sub_ps(load_ps_avx2(x + i),
+                                                  load_ps_avx2(y + i));
+                sum_0 = _mm256_fmadd_ps(diff, diff, sum_0);
+            }
+            float sum = reduce_add_avx2(
+                    _mm256_add_ps(_mm256_add_ps(sum_0, sum_1),
+                                  _mm256_add_ps(sum_2, sum_3)));
+            for (; i < d; ++i) {
+                const float diff = float(x[i]) - float(y[i]);
+                sum += diff * diff;
+            }
+            return sum;
+        }
+    }
+
+    template <typename T>
+    NNDESCENT_AVX2 float inner_product_avx2(const T* x, const T* y, size_t d) {
+        if constexpr (is_byte<T>) {
+            __m256i sum_0 = _mm256_setzero_si256();
+            __m256i sum_1 = _mm256_setzero_si256();
+            size_t i = 0;
+            for (; i + 32 <= d; i += 32) {
+                sum_0 = _mm256_add_epi32(sum_0, _mm256_madd_epi16(
+                        load_epi16_avx2(x + i), load_epi16_avx2(y + i)));
+                sum_1 = _mm256_add_epi32(sum_1, _mm256_madd_epi16(
+                        load_epi16_avx2(x + i + 16), load_epi16_avx2(y + i + 16)));
+            }
+            for (; i + 16 <= d; i += 16) {
+                sum_0 = _mm256_add_epi32(sum_0, _mm256_madd_epi16(
+                        load_epi16_avx2(x + i), load_epi16_avx2(y + i)));
+            }
+            int32_t sum = reduce_add_avx2(_mm256_add_epi32(sum_0, sum_1));
+            for (; i < d; ++i) sum += int32_t(x[i]) * int32_t(y[i]);
+            return float(sum);
+        } else {
+            __m256 sum_0 = _mm256_setzero_ps(), sum_1 = _mm256_setzero_ps();
+            __m256 sum_2 = _mm256_setzero_ps(), sum_3 = _mm256_setzero_ps();
+            size_t i = 0;
+            for (; i + 32 <= d; i += 32) {
+                sum_0 = _mm256_fmadd_ps(load_ps_avx2(x + i),
+                                        load_ps_avx2(y + i), sum_0);
+                sum_1 = _mm256_fmadd_ps(load_ps_avx2(x + i + 8),
+                                        load_ps_avx2(y + i + 8), sum_1);
+                sum_2 = _mm256_fmadd_ps(load_ps_avx2(x + i + 16),
+                                        load_ps_avx2(y + i + 16), sum_2);
+                sum_3 = _mm256_fmadd_ps(load_ps_avx2(x + i + 24),
+                                        load_ps_avx2(y + i + 24), sum_3);
+            }
+            for (; i + 8 <= d; i += 8) {
+                sum_0 = _mm256_fmadd_ps(load_ps_avx2(x + i),
+                                        load_ps_avx2(y + i), sum_0);
+            }
+            float sum = reduce_add_avx2(
+                    _mm256_add_ps(_mm256_add_ps(sum_0, sum_1),
+                                  _mm256_add_ps(sum_2, sum_3)));
+            for (; i < d; ++i) sum += float(x[i]) * float(y[i]);
+            return sum;
+        }
+    }
+
+    template <typename T>
+    NNDESCENT_AVX2 float l1_avx2(const T* x, const T* y, size_t d) {
+        if constexpr (is_byte<T>) {
+            // madd with ones widens the absolute differences to int32
+            const __m256i ones = _mm256_set1_epi16(1);
+            __m256i sum = _mm256_setzero_si256();
+            size_t i = 0;
+            for (; i + 16 <= d; i += 16) {
+                const __m256i diff = _mm256_sub_epi16(load_epi16_avx2(x + i),
+                                                      load_epi16_avx2(y + i));
+                sum = _mm256_add_epi32(sum, _mm256_madd_epi16(
+                        _mm256_abs_epi16(diff), ones));
+            }
+            int32_t result = reduce_add_avx2(sum);
+            for (; i < d; ++i) result += abs(int32_t(x[i]) - int32_t(y[i]));
+            return float(result);
+        } else {
+            // clearing the sign bit gives the absolute value
+            const __m256 abs_mask = _mm256_castsi256_ps(
+                    _mm256_set1_epi32(0x7fffffff));
+            __m256 sum_0 = _mm256_setzero_ps(), sum_1 = _mm256_setzero_ps();
+            size_t i = 0;
+            for (; i + 16 <= d; i += 16) {
+                const __m256 diff_0 = _mm256_sub_ps(load_ps_avx2(x + i),
+                                                    load_ps_avx2(y + i));
+                const __m256 diff_1 = _mm256_sub_ps(load_ps_avx2(x + i + 8),
+                                                    load_ps_avx2(y + i + 8));
+                sum_0 = _mm256_add_ps(sum_0, _mm256_and_ps(diff_0, abs_mask));
+                sum_1 = _mm256_add_ps(sum_1, _mm256_and_ps(diff_1, abs_mask));
+            }
+            for (; i + 8 <= d; i += 8) {
+                const __m256 diff = _mm256_sub_ps(load_ps_avx2(x + i),
+                                                  load_ps_avx2(y + i));
+                sum_0 = _mm256_add_ps(sum_0, _mm256_and_ps(diff, abs_mask));
+            }
+            float sum = reduce_add_avx2(_mm256_add_ps(sum_0, sum_1));
+            for (; i < d; ++i) sum += abs(float(x[i]) - float(y[i]));
+            return sum;
+        }
+    }
+
+    // 16 elements of a row as floats, zeros past the mask
+    NNDESCENT_AVX512 __m512 load_ps_avx512(const float* x,
+                                           __mmask16 mask = 0xffff) {
+        return _mm512_maskz_loadu_ps(mask, x);
+    }
+
+    NNDESCENT_AVX512 __m512 load_ps_avx512(const float16* x,
+                                           __mmask16 mask = 0xffff) {
+        return _mm512_cvtph_ps(_mm256_maskz_loadu_epi16(mask, x));
+    }
+
+    NNDESCENT_AVX512 __m512 load_ps_avx512(const bfloat16* x,
+                                           __mmask16 mask = 0xffff) {
+        const __m512i bits = _mm512_cvtepu16_epi32(
+                _mm256_maskz_loadu_epi16(mask, x));
+        return _mm512_castsi512_ps(_mm512_slli_epi32(bits, 16));
+    }
+
+    // 32 elements of a byte row as int16, zeros past the mask
+    NNDESCENT_AVX512 __m512i load_epi16_avx512(const int8_t* x,
+                                               __mmask32 mask = 0xffffffff) {
+        return _mm512_cvtepi8_epi16(_mm256_maskz_loadu_epi8(mask, x));
+    }
+
+    NNDESCENT_AVX512 __m512i load_epi16_avx512(const uint8_t* x,
+                                               __mmask32 mask = 0xffffffff) {
+        return _mm512_cvtepu8_epi16(_mm256_maskz_loadu_epi8(mask, x));
+    }
+
+    template <typename T>
+    NNDESCENT_AVX512 float l2_sqr_avx512(const T* x, const T* y, size_t d) {
+        if constexpr (is_byte<T>) {
+            __m512i sum_0 = _mm512_setzero_si512();
+            __m512i sum_1 = _mm512_setzero_si512();
+            size_t i = 0;
+            for (; i + 64 <= d; i += 64) {
+                const __m512i diff_0 = _mm512_sub_epi16(load_epi16_avx512(x + i),
+                                                        load_epi16_avx512(y + i));
+                const __m512i diff_1 = _mm512_sub_epi16(
+                        load_epi16_avx512(x + i + 32),
+                        load_epi16_avx512(y + i + 32));
+                sum_0 = _mm512_add_epi32(sum_0, _mm512_madd_epi16(diff_0, diff_0));
+                sum_1 = _mm512_add_epi32(sum_1, _mm512_madd_epi16(diff_1, diff_1));
+            }
+            for (; i < d; i += 32) {
+                // masked loads read zeros past the end of the rows
+                const __mmask32 mask = d - i >= 32 ?
+                                       0xffffffff : (1u << (d - i)) - 1;
+                const __m512i diff = _mm512_sub_epi16(
+                        load_epi16_avx512(x + i, mask),
+                        load_epi16_avx512(y + i, mask));
+                sum_0 = _mm512_add_epi32(sum_0, _mm512_madd_epi16(diff, diff));
+            }
+            return float(_mm512_reduce_add_epi32(_mm512_add_epi32(sum_0, sum_1)));
+        } else {
+            __m512 sum_0 = _mm512_setzero_ps(), sum_1 = _mm512_setzero_ps();
+            __m512 sum_2 = _mm512_setzero_ps(), sum_3 = _mm512_setzero_ps();
+            size_t i = 0;
+            for (; i + 64 <= d; i += 64) {
+                const __m512 diff_0 = _mm512_sub_ps(load_ps_avx512(x + i),
+                                                    load_ps_avx512(y + i));
+                const __m512 diff_1 = _mm512_sub_ps(load_ps_avx512(x + i + 16),
+                                                    load_ps_avx512(y + i + 16));
+                const __m512 diff_2 = _mm512_sub_ps(load_ps_avx512(x + i + 32),
+                                                    load_ps_avx512(y + i + 32));
+                const __m512 diff_3 = _mm512_sub_ps(load_ps_avx512(x + i + 48),
+                                                    load_ps_avx512(y + i + 48));
+                sum_0 = _mm512_fmadd_ps(diff_0, diff_0, sum_0);
+                sum_1 = _mm512_fmadd_ps(diff_1, diff_1, sum_1);
+                sum_2 = _mm512_fmadd_ps(diff_2, diff_2, sum_2);
+                sum_3 = _mm512_fmadd_ps(diff_3, diff_3, sum_3);
+            }
+            for (; i < d; i += 16) {
+                const __mmask16 mask = d - i >= 16 ? 0xffff : (1u << (d - i)) - 1;
+                const __m512 diff = _mm512_sub_ps(load_ps_avx512(x + i, mask),
+                                                  load_ps_avx512(y + i, mask));
+                sum_0 = _mm512_fmadd_ps(diff, diff, sum_0);
+            }
+            return _mm512_reduce_add_ps(
+                    _mm512_add_ps(_mm512_add_ps(sum_0, sum_1),
+                                  _mm512_add_ps(sum_2, sum_3)));
+        }
+    }
+
+    template <typename T>
+    NNDESCENT_AVX512 float inner_product_avx512(const T* x, const T* y,
+                                                size_t d) {
+        if constexpr (is_byte<T>) {
+            __m512i sum_0 = _mm512_setzero_si512();
+            __m512i sum_1 = _mm512_setzero_si512();
+            size_t i = 0;
+            for (; i + 64 <= d; i += 64) {
+                sum_0 = _mm512_add_epi32(sum_0, _mm512_madd_epi16(
+                        load_epi16_avx512(x + i), load_epi16_avx512(y + i)));
+                sum_1 = _mm512_add_epi32(sum_1, _mm512_madd_epi16(
+                        load_epi16_avx512(x + i + 32),
+                        load_epi16_avx512(y + i + 32)));
+            }
+            for (; i < d; i += 32) {
+                const __mmask32 mask = d - i >= 32 ?
+                                       0xffffffff : (1u << (d - i)) - 1;
+                sum_0 = _mm512_add_epi32(sum_0, _mm512_madd_epi16(
+                        load_epi16_avx512(x + i, mask),
+                        load_epi16_avx512(y + i, mask)));
+            }
+            return float(_mm512_reduce_add_epi32(_mm512_add_epi32(sum_0, sum_1)));
+        } else {
+            __m512 sum_0 = _mm512_setzero_ps(), sum_1 = _mm512_setzero_ps();
+            __m512 sum_2 = _mm512_setzero_ps(), sum_3 = _mm512_setzero_ps();
+            size_t i = 0;
+            for (; i + 64 <= d; i += 64) {
+                sum_0 = _mm512_fmadd_ps(load_ps_avx512(x + i),
+                                        load_ps_avx512(y + i), sum_0);
+                sum_1 = _mm512_fmadd_ps(load_ps_avx512(x + i + 16),
+                                        load_ps_avx512(y + i + 16), sum_1);
+                sum_2 = _mm512_fmadd_ps(load_ps_avx512(x + i + 32),
+                                        load_ps_avx512(y + i + 32), sum_2);
+                sum_3 = _mm512_fmadd_ps(load_ps_avx512(x + i + 48),
+                                        load_ps_avx512(y + i + 48), sum_3);
+            }
+            for (; i < d; i += 16) {
+                const __mmask16 mask = d - i >= 16 ? 0xffff : (1u << (d - i)) - 1;
+                sum_0 = _mm512_fmadd_ps(load_ps_avx512(x + i, mask),
+                                        load_ps_avx512(y + i, mask), sum_0);
+            }
+            return _mm512_reduce_add_ps(
+                    _mm512_add_ps(_mm512_add_ps(sum_0, sum_1),
+                                  _mm512_add_ps(sum_2, sum_3)));
+        }
+    }
+
+    template <typename T>
+    NNDESCENT_AVX512 float l1_avx512(const T* x, const T* y, size_t d) {
+        if constexpr (is_byte<T>) {
+            const __m512i ones = _mm512_set1_epi16(1);
+            __m512i sum = _mm512_setzero_si512();
+            for (size_t i = 0; i < d; i += 32) {
+                const __mmask32 mask = d - i >= 32 ?
+                                       0xffffffff : (1u << (d - i)) - 1;
+                const __m512i diff = _mm512_sub_epi16(
+                        load_epi16_avx512(x + i, mask),
+                        load_epi16_avx512(y + i, mask));
+                sum = _mm512_add_epi32(sum, _mm512_madd_epi16(
+                        _mm512_abs_epi16(diff), ones));
+            }
+            return float(_mm512_reduce_add_epi32(sum));
+        } else {
+            __m512 sum_0 = _mm512_setzero_ps(), sum_1 = _mm512_setzero_ps();
+            size_t i = 0;
+            for (; i + 32 <= d; i += 32) {
+                sum_0 = _mm512_add_ps(sum_0, _mm512_abs_ps(_mm512_sub_ps(
+                        load_ps_avx512(x + i), load_ps_avx512(y + i))));
+                sum_1 = _mm512_add_ps(sum_1, _mm512_abs_ps(_mm512_sub_ps(
+                        load_ps_avx512(x + i + 16), load_ps_avx512(y + i + 16))));
+            }
+            for (; i < d; i += 16) {
+                const __mmask16 mask = d - i >= 16 ? 0xffff : (1u << (d - i)) - 1;
+                sum_0 = _mm512_add_ps(sum_0, _mm512_abs_ps(_mm512_sub_ps(
+                        load_ps_avx512(x + i, mask), load_ps_avx512(y + i, mask))));
+            }
+            return _mm512_reduce_add_ps(_mm512_add_ps(sum_0, sum_1));
+        }
+    }
+#endif
+
+    auto detect_simd_level() {
+#ifdef NNDESCENT_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") &&
+            __builtin_cpu_supports("avx512bw") &&
+            __builtin_cpu_supports("avx512vl"))
+            return SimdLevel::avx512;
+        // the avx2 kernels convert float16 rows with f16c
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") &&
+            __builtin_cpu_supports("f16c"))
+            return SimdLevel::avx2;
+#endif
+        return SimdLevel::scalar;
+    }
+
+    auto simd_level_name(SimdLevel level) {
+        switch (level) {
+            case SimdLevel::scalar: return string("scalar");
+            case SimdLevel::avx2: return string("avx2");
+            case SimdLevel::avx512: return string("avx512");
+        }
+        throw runtime_error("invalid simd level");
+    }
+
+    // NNDESCENT_SIMD=scalar|avx2|avx512 caps the detected level
+    auto select_simd_level() {
+        auto level = detect_simd_level();
+        if (const char* env = getenv("NNDESCENT_SIMD")) {
+            const string name(env);
+            if (name == "scalar") level = SimdLevel::scalar;
+            else if (name == "avx2" && level == SimdLevel::avx512)
+                level = SimdLevel::avx2;
+        }
+        return level;
+    }
+
+    template <typename T>
+    using DistanceFunction = float (*)(const T*, const T*, size_t);
+
+    // distances of x to each of the m rows ys into out
+    template <typename T>
+    using BatchFunction = void (*)(const T*, const T* const*, size_t, size_t,
+                                   float*);
+
+    // rows are prefetched this far ahead of the one being evaluated
+    constexpr size_t prefetch_distance = 4;
+
+    template <typename T>
+    inline void prefetch_row(const T* y, size_t d) {
+        const auto bytes = d * sizeof(T);
+        for (size_t offset = 0; offset < bytes; offset += 64) {
+            __builtin_prefetch((const char*)y + offset);
+        }
+    }
+
+    // one row at a time with the next rows prefetched, for kernels without
+    // a multi-row form
+    template <typename T, DistanceFunction<T> distance>
+    void batch_rows(const T* x, const T* const* ys, size_t m, size_t d,
+                    float* out) {
+        for (size_t j = 0; j < m; ++j) {
+            if (j + prefetch_distance < m) prefetch_row(ys[j + prefetch_distance], d);
+            out[j] = distance(x, ys[j], d);
+        }
+    }
+
+#ifdef NNDESCENT_X86
+    template <bool is_l2>
+    NNDESCENT_AVX2 __m256 accumulate_avx2(__m256 x, __m256 y, __m256 sum) {
+        if constexpr (is_l2) {
+            const __m256 diff = _mm256_sub_ps(x, y);
+            return _mm256_fmadd_ps(diff, diff, sum);
+        } else {
+            return _mm256_fmadd_ps(x, y, sum);
+        }
+    }
+
+    template <bool is_l2>
+    NNDESCENT_AVX512 __m512 accumulate_avx512(__m512 x, __m512 y, __m512 sum) {
+        if constexpr (is_l2) {
+            const __m512 diff = _mm512_sub_ps(x, y);
+            return _mm512_fmadd_ps(diff, diff, sum);
+        } else {
+            return _mm512_fmadd_ps(x, y, sum);
+        }
+    }
+
+    template <typename T, bool is_l2>
+    inline float accumulate_scalar(const T* x, const T* y, size_t i, size_t d,
+                                   float sum) {
+        for (; i < d; ++i) {
+            if constexpr (is_l2) {
+                const float diff = float(x[i]) - float(y[i]);
+                sum += diff * diff;
+            } else {
+                sum += float(x[i]) * float(y[i]);
+            }
+        }
+        return sum;
+    }
+
+    // two rows per pass share every load of x. the sums follow the single
+    // row kernels step for step, so the distances are bit-identical.
+    template <typename T, bool is_l2>
+    NNDESCENT_AVX2 void batch_2_avx2(const T* x, const T* y_0, const T* y_1,
+                                     size_t d, float* out) {
+        __m256 sum_0 = _mm256_setzero_ps(), sum_1 = _mm256_setzero_ps();
+        __m256 sum_2 = _mm256_setzero_ps(), sum_3 = _mm256_setzero_ps();
+        __m256 sum_4 = _mm256_setzero_ps(), sum_5 = _mm256_setzero_ps();
+        __m256 sum_6 = _mm256_setzero_ps(), sum_7 = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i + 32 <= d; i += 32) {
+            const __m256 x_0 = load_ps_avx2(x + i), x_1 = load_ps_avx2(x + i + 8);
+            const __m256 x_2 = load_ps_avx2(x + i + 16), x_3 = load_ps_avx2(x + i + 24);
+            sum_0 = accumulate_avx2<is_l2>(x_0, load_ps_avx2(y_0 + i), sum_0);
+            sum_1 = accumulate_avx2<is_l2>(x_1, load_ps_avx2(y_0 + i + 8), sum_1);
+            sum_2 = accumulate_avx2<is_l2>(x_2, load_ps_avx2(y_0 + i + 16), sum_2);
+            sum_3 = accumulate_avx2<is_l2>(x_3, load_ps_avx2(y_0 + i + 24), sum_3);
+            sum_4 = accumulate_avx2<is_l2>(x_0, load_ps_avx2(y_1 + i), sum_4);
+            sum_5 = accumulate_avx2<is_l2>(x_1, load_ps_avx2(y_1 + i + 8), sum_5);
+            sum_6 = accumulate_avx2<is_l2>(x_2, load_ps_avx2(y_1 + i + 16), sum_6);
+            sum_7 = accumulate_avx2<is_l2>(x_3, load_ps_avx2(y_1 + i + 24), sum_7);
+        }
+        for (; i + 8 <= d; i += 8) {
+            const __m256 x_i = load_ps_avx2(x + i);
+            sum_0 = accumulate_avx2<is_l2>(x_i, load_ps_avx2(y_0 + i), sum_0);
+            sum_4 = accumulate_avx2<is_l2>(x_i, load_ps_avx2(y_1 + i), sum_4);
+        }
+        out[0] = accumulate_scalar<T, is_l2>(x, y_0, i, d, reduce_add_avx2(
+                _mm256_add_ps(_mm256_add_ps(sum_0, sum_1),
+                              _mm256_add_ps(sum_2, sum_3))));
+        out[1] = accumulate_scalar<T, is_l2>(x, y_1, i, d, reduce_add_avx2(
+                _mm256_add_ps(_mm256_add_ps(sum_4, sum_5),
+                              _mm256_add_ps(sum_6, sum_7))));
+    }
+
+    template <typename T, bool is_l2>
+    NNDESCENT_AVX512 void batch_2_avx512(const T* x, const T* y_0,
+                                         const T* y_1, size_t d, float* out) {
+        __m512 sum_0 = _mm512_setzero_ps(), sum_1 = _mm512_setzero_ps();
+        __m512 sum_2 = _mm512_setzero_ps(), sum_3 = _mm512_setzero_ps();
+        __m512 sum_4 = _mm512_setzero_ps(), sum_5 = _mm512_setzero_ps();
+        __m512 sum_6 = _mm512_setzero_ps(), sum_7 = _mm512_setzero_ps();
+        size_t i = 0;
+        for (; i + 64 <= d; i += 64) {
+            const __m512 x_0 = load_ps_avx512(x + i), x_1 = load_ps_avx512(x + i + 16);
+            const __m512 x_2 = load_ps_avx512(x + i + 32), x_3 = load_ps_avx512(x + i + 48);
+            sum_0 = accumulate_avx512<is_l2>(x_0, load_ps_avx512(y_0 + i), sum_0);
+            sum_1 = accumulate_avx512<is_l2>(x_1, load_ps_avx512(y_0 + i + 16), sum_1);
+            sum_2 = accumulate_avx512<is_l2>(x_2, load_ps_avx512(y_0 + i + 32), sum_2);
+            sum_3 = accumulate_avx512<is_l2>(x_3, load_ps_avx512(y_0 + i + 48), sum_3);
+            sum_4 = accumulate_avx512<is_l2>(x_0, load_ps_avx512(y_1 + i), sum_4);
+            sum_5 = accumulate_avx512<is_l2>(x_1, load_ps_avx512(y_1 + i + 16), sum_5);
+            sum_6 = accumulate_avx512<is_l2>(x_2, load_ps_avx512(y_1 + i + 32), sum_6);
+            sum_7 = accumulate_avx512<is_l2>(x_3, load_ps_avx512(y_1 + i + 48), sum_7);
+        }
+        for (; i < d; i += 16) {
+            const __mmask16 mask = d - i >= 16 ? 0xffff : (1u << (d - i)) - 1;
+            const __m512 x_i = load_ps_avx512(x + i, mask);
+            sum_0 = accumulate_avx512<is_l2>(x_i, load_ps_avx512(y_0 + i, mask), sum_0);
+            sum_4 = accumulate_avx512<is_l2>(x_i, load_ps_avx512(y_1 + i, mask), sum_4);
+        }
+        out[0] = _mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(sum_0, sum_1),
+                                                    _mm512_add_ps(sum_2, sum_3)));
+        out[1] = _mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(sum_4, sum_5),
+                                                    _mm512_add_ps(sum_6, sum_7)));
+    }
+
+    template <typename T, bool is_l2>
+    NNDESCENT_AVX2 void batch_avx2(const T* x, const T* const* ys, size_t m,
+                                   size_t d, float* out) {
+        size_t j = 0;
+        if constexpr (!is_byte<T>) {
+            for (; j + 2 <= m; j += 2) {
+                for (auto k = j + 2; k < min(m, j + 2 + prefetch_distance); ++k) {
+                    prefetch_row(ys[k], d);
+                }
+                batch_2_avx2<T, is_l2>(x, ys[j], ys[j + 1], d, out + j);
+            }
+        }
+        batch_rows<T, is_l2 ? l2_sqr_avx2<T> : inner_product_avx2<T>>(
+                x, ys + j, m - j, d, out + j);
+    }
+
+    template <typename T, bool is_l2>
+    NNDESCENT_AVX512 void batch_avx512(const T* x, const T* const* ys,
+                                       size_t m, size_t d, float* out) {
+        size_t j = 0;
+        if constexpr (!is_byte<T>) {
+            for (; j + 2 <= m; j += 2) {
+                for (auto k = j + 2; k < min(m, j + 2 + prefetch_distance); ++k) {
+                    prefetch_row(ys[k], d);
+                }
+                batch_2_avx512<T, is_l2>(x, ys[j], ys[j + 1], d, out + j);
+            }
+        }
+        batch_rows<T, is_l2 ? l2_sqr_avx512<T> : inner_product_avx512<T>>(
+                x, ys + j, m - j, d, out + j);
+    }
+#endif
+
+    template <typename T>
+    struct Kernels {
+        SimdLevel level;
+        DistanceFunction<T> l2_sqr;
+        DistanceFunction<T> inner_product;
+        DistanceFunction<T> l1;
+        BatchFunction<T> l2_sqr_batch;
+        BatchFunction<T> inner_product_batch;
+        BatchFunction<T> l1_batch;
+    };
+
+    template <typename T>
+    auto make_kernels(SimdLevel level) {
+        switch (level) {
+#ifdef NNDESCENT_X86
+            case SimdLevel::avx512:
+                return Kernels<T>{level, l2_sqr_avx512<T>,
+                                  inner_product_avx512<T>, l1_avx512<T>,
+                                  batch_avx512<T, true>, batch_avx512<T, false>,
+                                  batch_rows<T, l1_avx512<T>>};
+            case SimdLevel::avx2:
+                return Kernels<T>{level, l2_sqr_avx2<T>,
+                                  inner_product_avx2<T>, l1_avx2<T>,
+                                  batch_avx2<T, true>, batch_avx2<T, false>,
+                                  batch_rows<T, l1_avx2<T>>};
+#endif
+            default:
+                return Kernels<T>{SimdLevel::scalar, l2_sqr_scalar<T>,
+                                  inner_product_scalar<T>, l1_scalar<T>,
+                                  batch_rows<T, l2_sqr_scalar<T>>,
+                                  batch_rows<T, inner_product_scalar<T>>,
+                                  batch_rows<T, l1_scalar<T>>};
+        }
+    }
+
+    // the wrappers below call through these pointers, so every call is an
+    // indirect call that the compiler cannot inline into the caller. the
+    // batch forms pay it once per batch instead of once per pair.
+    template <typename T>
+    inline Kernels<T> active = make_kernels<T>(select_simd_level());
+
+    // squared euclidean distance: enough wherever only the order matters
+    template <typename T>
+    inline float l2_sqr(const T* x, const T* y, size_t d) {
+        return active<T>.l2_sqr(x, y, d);
+    }
+
+    template <typename T>
+    inline float inner_product(const T* x, const T* y, size_t d) {
+        return active<T>.inner_product(x, y, d);
+    }
+
+    template <typename T>
+    inline float l1(const T* x, const T* y, size_t d) {
+        return active<T>.l1(x, y, d);
+    }
+
+    template <typename T>
+    inline void l2_sqr_batch(const T* x, const T* const* ys, size_t m,
+                             size_t d, float* out) {
+        active<T>.l2_sqr_batch(x, ys, m, d, out);
+    }
+
+    template <typename T>
+    inline void inner_product_batch(const T* x, const T* const* ys, size_t m,
+                                    size_t d, float* out) {
+        active<T>.inner_product_batch(x, ys, m, d, out);
+    }
+
+    template <typename T>
+    inline void l1_batch(const T* x, const T* const* ys, size_t m, size_t d,
+                         float* out) {
+        active<T>.l1_batch(x, ys, m, d, out);
+    }
+}
+
+#endif //NNDESCENT_KERNELS_HPP
@@ -6,156 +6,2100 @@
 #define NNDESCENT_NNDESCENT_HPP
 
 #include <cpputil.hpp>
+#include <kernels.hpp>
 #include <random>
+#include <mutex>
+#include <numeric>
+#include <queue>
+#include <future>
+#include <functional>
+#include <deque>
+#include <cerrno>
+#include <sys/wait.h>
 
 using namespace std;
 using namespace cpputil;
 
 namespace nndescent {
+    struct Edge {
+        float dist;
+        int id;
+        bool is_new;
+
+        Edge() : dist(float_max), id(-1), is_new(false) {}
+        Edge(float dist, int id, bool is_new = true) :
+                dist(dist), id(id), is_new(is_new) {}
+    };
+
+    // view of one node's neighbors, sorted by distance
+    struct EdgeRow {
+        Edge* first;
+        int n_edges;
+
+        EdgeRow(Edge* first, int n_edges) : first(first), n_edges(n_edges) {}
+
+        auto size() const { return static_cast<size_t>(n_edges); }
+        auto empty() const { return n_edges == 0; }
+        auto begin() const { return first; }
+        auto end() const { return first + n_edges; }
+        auto& operator[](int i) const { return first[i]; }
+        auto& front() const { return first[0]; }
+        auto& back() const { return first[n_edges - 1]; }
+    };
+
+    // contiguous n x K neighbor pool instead of one node-based container per
+    // node, so updates touch a single cache-friendly row
+    struct EdgeSet {
+        int n, K;
+        vector<Edge> pool;
+        vector<int> degree;
+        // rows living in a (copy-on-write) mapping instead of pool
+        shared_ptr<MappedRegion> region;
+        Edge* mapped = nullptr;
+
+        EdgeSet(int n, int K) :
+                n(n), K(K), pool(static_cast<size_t>(n) * K), degree(n, 0) {}
+
+        // a copy holds its rows in pool, so neither side writes through the
+        // mapping of the other
+        EdgeSet(const EdgeSet& other) :
+                n(other.n), K(other.K),
+                pool(other.edges(),
+                     other.edges() + static_cast<size_t>(other.n) * other.K),
+                degree(other.degree) {}
+
+        EdgeSet(EdgeSet&& other) noexcept :
+                n(other.n), K(other.K), pool(move(other.pool)),
+                degree(move(other.degree)), region(move(other.region)),
+                mapped(exchange(other.mapped, nullptr)) {}
+
+        EdgeSet& operator=(const EdgeSet& other) {
+            if (this != &other) *this = EdgeSet(other);
+            return *this;
+        }
+
+        EdgeSet& operator=(EdgeSet&& other) noexcept {
+            n = other.n;
+            K = other.K;
+            pool = move(other.pool);
+            degree = move(other.degree);
+            region = move(other.region);
+            mapped = exchange(other.mapped, nullptr);
+            return *this;
+        }
+
+        auto size() const { return static_cast<size_t>(n); }
+        auto n_slots() const { return static_cast<size_t>(n) * K; }
+
+        Edge* edges() { return mapped ? mapped : pool.data(); }
+        const Edge* edges() const { return mapped ? mapped : pool.data(); }
+
+        auto operator[](int i) {
+            return EdgeRow(edges() + static_cast<size_t>(i) * K, degree[i]);
+        }
+
+        // grows to new_n nodes with empty rows. mapped rows are copied into
+        // pool first.
+        auto resize(int new_n) {
+            if (mapped) {
+                pool.assign(mapped, mapped + n_slots());
+                region.reset();
+                mapped = nullptr;
+            }
+            n = new_n;
+            pool.resize(n_slots());
+            degree.resize(n, 0);
+        }
+
+        auto contains(int head_id, int tail_id) const {
+            const auto* row = edges() + static_cast<size_t>(head_id) * K;
+            for (int i = 0; i < degree[head_id]; ++i) {
+                if (row[i].id == tail_id) return true;
+            }
+            return false;
+        }
+
+        // sorted insert into the bounded row of head_id, dropping the
+        // furthest neighbor when the row is full. tail_id must not be in it.
+        int insert(int head_id, float dist, int tail_id, bool is_new = true) {
+            auto* row = edges() + static_cast<size_t>(head_id) * K;
+            auto& n_edges = degree[head_id];
+
+            if (n_edges >= K && dist >= row[K - 1].dist) return 0;
+
+            int pos = n_edges < K ? n_edges : K - 1;
+            for (; pos > 0 && row[pos - 1].dist > dist; --pos) {
+                row[pos] = row[pos - 1];
+            }
+            row[pos] = Edge(dist, tail_id, is_new);
+
+            if (n_edges < K) ++n_edges;
+            return 1;
+        }
+
+        // drops the neighbors of head_id matching pred, keeping the order
+        template <typename Pred>
+        int erase_if(int head_id, const Pred& pred) {
+            auto* row = edges() + static_cast<size_t>(head_id) * K;
+            auto& n_edges = degree[head_id];
+            const auto last = remove_if(row, row + n_edges, pred);
+            const int n_erased = row + n_edges - last;
+            n_edges -= n_erased;
+            return n_erased;
+        }
+    };
+
+    // metric policies: distance() is the internal distance used for ordering,
+    // distances() the same for m rows at once, and external() / internal()
+    // convert it to and from the reported distance. the policies are static,
+    // but the kernels behind them are selected at runtime and reached by an
+    // indirect call (kernels::active), which the join amortizes with
+    // distances().
+    namespace metric {
+        struct L2 {
+            static constexpr uint32_t code = 0;
+            static constexpr bool normalize = false;
+            template <typename T>
+            static float distance(const T* x, const T* y, size_t dim) {
+                return kernels::l2_sqr(x, y, dim);
+            }
+            template <typename T>
+            static void distances(const T* x, const T* const* ys, size_t m,
+                                  size_t dim, float* out) {
+                kernels::l2_sqr_batch(x, ys, m, dim, out);
+            }
+            static float external(float dist) { return sqrt(dist); }
+            static float internal(float dist) { return dist * dist; }
+        };
+
+        // maximum inner product search: larger products are closer
+        struct InnerProduct {
+            static constexpr uint32_t code = 1;
+            static constexpr bool normalize = false;
+            template <typename T>
+            static float distance(const T* x, const T* y, size_t dim) {
+                return -kernels::inner_product(x, y, dim);
+            }
+            template <typename T>
+            static void distances(const T* x, const T* const* ys, size_t m,
+                                  size_t dim, float* out) {
+                kernels::inner_product_batch(x, ys, m, dim, out);
+                for (size_t j = 0; j < m; ++j) out[j] = -out[j];
+            }
+            static float external(float dist) { return dist; }
+            static float internal(float dist) { return dist; }
+        };
+
+        // rows are normalized once on load, so cosine distance reduces to
+        // one minus the inner product
+        struct Cosine {
+            static constexpr uint32_t code = 2;
+            static constexpr bool normalize = true;
+            template <typename T>
+            static float distance(const T* x, const T* y, size_t dim) {
+                return 1 - kernels::inner_product(x, y, dim);
+            }
+            template <typename T>
+            static void distances(const T* x, const T* const* ys, size_t m,
+                                  size_t dim, float* out) {
+                kernels::inner_product_batch(x, ys, m, dim, out);
+                for (size_t j = 0; j < m; ++j) out[j] = 1 - out[j];
+            }
+            static float external(float dist) { return dist; }
+            static float internal(float dist) { return dist; }
+        };
+
+        // same order as cosine distance, reported as the angle over pi
+        struct Angular {
+            static constexpr uint32_t code = 3;
+            static constexpr bool normalize = true;
+            template <typename T>
+            static float distance(const T* x, const T* y, size_t dim) {
+                return 1 - kernels::inner_product(x, y, dim);
+            }
+            template <typename T>
+            static void distances(const T* x, const T* const* ys, size_t m,
+                                  size_t dim, float* out) {
+                kernels::inner_product_batch(x, ys, m, dim, out);
+                for (size_t j = 0; j < m; ++j) out[j] = 1 - out[j];
+            }
+            static float external(float dist) {
+                return acos(clip(1 - dist, -1.0f, 1.0f)) / pi;
+            }
+            static float internal(float dist) { return 1 - cos(dist * pi); }
+        };
+
+        struct L1 {
+            static constexpr uint32_t code = 4;
+            static constexpr bool normalize = false;
+            template <typename T>
+            static float distance(const T* x, const T* y, size_t dim) {
+                return kernels::l1(x, y, dim);
+            }
+            template <typename T>
+            static void distances(const T* x, const T* const* ys, size_t m,
+                                  size_t dim, float* out) {
+                kernels::l1_batch(x, ys, m, dim, out);
+            }
+            static float external(float dist) { return dist; }
+            static float internal(float dist) { return dist; }
+        };
+    }
+
+    // header of the .graph format. the payload is n rows of K edges, row i
+    // holding degree[i] edges sorted by internal distance and zeros after
+    // them, followed by the n degrees (int32)
+    struct GraphHeader {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t metric;
+        uint32_t element;
+        uint32_t dim;
+        uint64_t n;
+        uint64_t K;
+        // sum over rows of mix64(checksum64(row) ^ i), plus the checksum of
+        // the degrees
+        uint64_t checksum;
+        uint64_t reserved[2];
+    };
+
+    constexpr uint64_t graph_magic = 0x48504152474e4e4e;  // "NNNGRAPH"
+    constexpr uint32_t graph_version = 1;
+
+    static_assert(sizeof(GraphHeader) == 64, "graph header is 64 bytes");
+    static_assert(is_trivially_copyable_v<Edge>, "edges are stored raw");
+
+    inline uint64_t graph_row_checksum(const Edge* row, size_t K, size_t i) {
+        return mix64(checksum64((const char*)row, K * sizeof(Edge)) ^ i);
+    }
+
+    // writes the rows given by row(i), any range of Edge, in one pass
+    template <typename Row>
+    auto write_graph(const string& path, GraphHeader header, const Row& row) {
+        header.magic = graph_magic;
+        header.version = graph_version;
+        header.checksum = 0;
+
+        ofstream ofs(path, ios::binary);
+        if (!ofs)
+            throw runtime_error("can't open file: " + path);
+        ofs.write((const char*)&header, sizeof(header));
+
+        vector<int> degree(header.n);
+        vector<Edge> line(header.K);
+        for (size_t i = 0; i < header.n; ++i) {
+            // zeroed padding keeps the file and its checksum deterministic
+            memset((void*)line.data(), 0, line.size() * sizeof(Edge));
+            int n_edges = 0;
+            for (const auto& edge : row(i)) {
+                if (n_edges >= header.K)
+                    throw runtime_error("row exceeds K: " + to_string(i));
+                line[n_edges].dist = edge.dist;
+                line[n_edges].id = edge.id;
+                line[n_edges].is_new = edge.is_new;
+                ++n_edges;
+            }
+            degree[i] = n_edges;
+            header.checksum += graph_row_checksum(line.data(), header.K, i);
+            ofs.write((const char*)line.data(), line.size() * sizeof(Edge));
+        }
+        ofs.write((const char*)degree.data(), degree.size() * sizeof(int));
+        header.checksum += checksum64((const char*)degree.data(),
+                                      degree.size() * sizeof(int));
+
+        ofs.seekp(0);
+        ofs.write((const char*)&header, sizeof(header));
+        if (!ofs)
+            throw runtime_error("can't write graph: " + path);
+    }
+
+    // rows of a .graph file used in place from a copy-on-write mapping
+    struct MappedGraph {
+        shared_ptr<MappedRegion> file;
+        GraphHeader header;
+        Edge* edges;
+        const int* degree;
+    };
+
+    auto map_graph(const string& path, bool verify_checksum = true) {
+        MappedGraph graph;
+        graph.file = map_file(path);
+        auto& header = graph.header;
+        if (graph.file->size < sizeof(header))
+            throw runtime_error("not a graph file: " + path);
+        memcpy(&header, graph.file->begin(), sizeof(header));
+        if (header.magic != graph_magic)
+            throw runtime_error("not a graph file: " + path);
+        if (header.version != graph_version)
+            throw runtime_error("unsupported graph version: " +
+                                to_string(header.version));
+        const auto n_slots = header.n * header.K;
+        if (graph.file->size != sizeof(header) + n_slots * sizeof(Edge) +
+                                header.n * sizeof(int))
+            throw runtime_error("graph file is truncated: " + path);
+
+        graph.edges = reinterpret_cast<Edge*>(graph.file->begin() + sizeof(header));
+        graph.degree = reinterpret_cast<const int*>(graph.edges + n_slots);
+        if (!verify_checksum) return graph;
+
+        uint64_t checksum = checksum64((const char*)graph.degree,
+                                       header.n * sizeof(int));
+#pragma omp parallel for reduction(+:checksum)
+        for (size_t i = 0; i < header.n; ++i) {
+            checksum += graph_row_checksum(graph.edges + i * header.K,
+                                           header.K, i);
+        }
+        if (checksum != header.checksum)
+            throw runtime_error("graph checksum not matched: " + path);
+        return graph;
+    }
+
+    enum class JoinMode {
+        // each node updates only its own list, every pair is evaluated
+        // once from each side
+        pull,
+        // each pair is evaluated once, skipped when already in both lists,
+        // and updates both lists under locks
+        symmetric
+    };
+
+    enum class InitMode {
+        // K uniformly random neighbors per node
+        random,
+        // leaf-mates in a forest of random projection trees
+        rp_forest
+    };
+
+    enum class ReorderMode {
+        none,
+        // breadth-first from node 0, then from the next unvisited node
+        bfs,
+        // reverse Cuthill-McKee: breadth-first from a node of least degree
+        // in every component, neighbors by increasing degree, reversed
+        rcm,
+        // greedy window ordering after Gorder: the next node shares the
+        // most edges and in-neighbors with the last placed nodes. about K^2
+        // heap operations per node.
+        gorder
+    };
+
+    // counters of one thread, a cache line apart from the next thread's
+    struct alignas(64) ThreadStats {
+        long long n_distances = 0;
+        long long n_updates = 0;
+        // candidates already in the list
+        long long n_duplicates = 0;
+        // busy time in the join
+        double join_seconds = 0;
+    };
+
+    struct IterationStats {
+        int iteration = 0;
+        long long n_updated = 0;
+        long long n_distances = 0;
+        long long n_duplicates = 0;
+        // seconds per phase
+        double candidates_seconds = 0;
+        double join_seconds = 0;
+        double recall_seconds = 0;
+        // since the start of the build loop
+        double elapsed_seconds = 0;
+        // slowest thread's join time over the mean
+        double imbalance = 1;
+        // on the sampled nodes, -1 when not sampled
+        float recall = -1;
+        vector<ThreadStats> threads;
+
+        auto to_json() const {
+            json result;
+            result["iteration"] = iteration;
+            result["n_updated"] = n_updated;
+            result["n_distances"] = n_distances;
+            result["n_duplicates"] = n_duplicates;
+            result["candidates_seconds"] = candidates_seconds;
+            result["join_seconds"] = join_seconds;
+            result["recall_seconds"] = recall_seconds;
+            result["elapsed_seconds"] = elapsed_seconds;
+            result["imbalance"] = imbalance;
+            if (recall >= 0) result["recall"] = recall;
+            result["threads"] = json::array();
+            for (const auto& thread : threads) {
+                result["threads"].push_back({
+                        {"n_distances", thread.n_distances},
+                        {"n_updates", thread.n_updates},
+                        {"n_duplicates", thread.n_duplicates},
+                        {"join_seconds", thread.join_seconds}});
+            }
+            return result;
+        }
+    };
+
+    struct BuildParams {
+        // sample rate: at most rho * K new neighbors per node take part in
+        // each local join
+        float rho = 1.0;
+        // stop when an iteration updates fewer than delta * n * K edges
+        float delta = 0.001;
+        // iteration cap, 0 for no cap
+        int max_iterations = 0;
+        // wall-clock budget of the iterations in seconds, 0 for no budget
+        double time_budget = 0;
+        JoinMode join_mode = JoinMode::pull;
+        // cap on the sampled reverse neighbors of each flag per node, which
+        // bounds the join cost of hubs. 0 for rho * K.
+        int max_reverse = 0;
+        InitMode init_mode = InitMode::random;
+        // random projection forest used by InitMode::rp_forest
+        int n_trees = 8;
+        int leaf_size = 64;
+        // written in the background every checkpoint_interval iterations
+        // and when the build stops, if not empty
+        string checkpoint_path;
+        int checkpoint_interval = 1;
+        // print every iteration to stdout
+        bool verbose = true;
+        // nodes whose exact neighbors are computed up front to estimate the
+        // recall of every iteration, 0 for none
+        int recall_samples = 0;
+        // json lines of every iteration, if not empty
+        string stats_path;
+        // renumbers the nodes for locality once after reorder_iteration
+        // iterations
+        ReorderMode reorder = ReorderMode::none;
+        int reorder_iteration = 1;
+        // called after every iteration
+        function<void(const IterationStats&)> on_iteration;
+    };
+
+    struct InsertParams {
+        // beam width of the search that seeds new nodes
+        int ef = 64;
+        // stop when a round updates fewer than delta * n_new * K edges
+        float delta = 0.001;
+        // round cap of the local refinement, 0 for no cap
+        int max_iterations = 8;
+        // striped locks guarding the lists during refinement
+        int n_locks = 4096;
+        // print every round to stdout
+        bool verbose = true;
+    };
+
+    struct IdRange {
+        const int* first;
+        const int* last;
+
+        auto size() const { return static_cast<size_t>(last - first); }
+        auto begin() const { return first; }
+        auto end() const { return last; }
+        auto operator[](size_t i) const { return first[i]; }
+    };
+
+    // per-node id lists in CSR layout. each row has room for an upper bound
+    // of its length and keeps its actual length in sizes.
+    struct CandidateList {
+        vector<size_t> offsets;
+        vector<int> sizes;
+        vector<int> ids;
+
+        auto operator[](int i) const {
+            const auto first = ids.data() + offsets[i];
+            return IdRange{first, first + sizes[i]};
+        }
+    };
+
+    // forward and reverse candidates of the local join, split by the new
+    // flag. all buffers are kept between iterations to avoid reallocation.
+    struct Candidates {
+        CandidateList new_list, old_list;
+        // sampled forward neighbors, K slots per node
+        vector<int> forward_new, forward_old;
+        vector<int> n_forward_new, n_forward_old;
+        // reverse neighbors in CSR layout before capping
+        vector<size_t> reverse_new_offsets, reverse_old_offsets;
+        vector<int> reverse_new, reverse_old;
+        vector<int> n_reverse_new, n_reverse_old;
+        // nodes whose candidates of each flag include a node, for the
+        // symmetric join
+        CandidateList new_inverse, old_inverse;
+    };
+
+    // exclusive prefix sum of counts into offsets (size n + 1)
+    template <typename Count>
+    auto prefix_sum(const vector<Count>& counts, vector<size_t>& offsets) {
+        offsets.resize(counts.size() + 1);
+        offsets[0] = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            offsets[i + 1] = offsets[i] + counts[i];
+        }
+    }
+
+    // visited marks that are cleared in O(1) by moving to a new epoch
+    struct VisitedSet {
+        vector<uint32_t> tags;
+        uint32_t epoch = 0;
+
+        auto clear(size_t n) {
+            if (tags.size() < n) tags.resize(n, 0);
+            if (++epoch != 0) return;
+            fill(tags.begin(), tags.end(), 0);
+            epoch = 1;
+        }
+
+        // true the first time id is visited in this epoch
+        auto visit(int id) {
+            if (tags[id] == epoch) return false;
+            tags[id] = epoch;
+            return true;
+        }
+    };
+
+    // per-thread buffers of the local join, grown to the largest batch and
+    // kept across nodes
+    template <typename T>
+    struct JoinBuffer {
+        vector<int> ids;
+        vector<const T*> rows;
+        vector<float> dists;
+        VisitedSet visited;
+    };
+
+    // best-first beam search: the ef closest nodes found so far are kept,
+    // and the search stops when the closest unexpanded node is further than
+    // all of them. expand(id, offer) offers every neighbor of id. returns
+    // the k nearest with the distances given by distance(id), among the
+    // nodes passing accept(id); rejected nodes are still expanded.
+    template <typename Distance, typename Expand, typename Accept>
+    auto beam_search(const vector<int>& entry_points, int n, int k, int ef,
+                     const Distance& distance, const Expand& expand,
+                     const Accept& accept) {
+        ef = max(ef, k);
+
+        // one visited set per thread, reused across queries
+        thread_local VisitedSet visited;
+        visited.clear(n);
+
+        priority_queue<Neighbor, vector<Neighbor>, CompGreater> frontier;
+        priority_queue<Neighbor, vector<Neighbor>, CompLess> nearest;
+        const auto offer = [&](int id) {
+            if (!visited.visit(id)) return;
+            const auto dist = distance(id);
+            if (nearest.size() >= ef && dist >= nearest.top().dist) return;
+            frontier.emplace(dist, id);
+            if (!accept(id)) return;
+            nearest.emplace(dist, id);
+            if (nearest.size() > ef) nearest.pop();
+        };
+
+        for (const auto id : entry_points) offer(id);
+
+        while (!frontier.empty()) {
+            const auto current = frontier.top();
+            if (nearest.size() >= ef && current.dist > nearest.top().dist)
+                break;
+            frontier.pop();
+            expand(current.id, offer);
+        }
+
+        while (nearest.size() > k) nearest.pop();
+        Neighbors result(nearest.size());
+        for (auto i = result.size(); i > 0; --i) {
+            result[i - 1] = nearest.top();
+            nearest.pop();
+        }
+        return result;
+    }
+
+    template <typename Distance, typename Expand>
+    auto beam_search(const vector<int>& entry_points, int n, int k, int ef,
+                     const Distance& distance, const Expand& expand) {
+        return beam_search(entry_points, n, k, ef, distance, expand,
+                           [](int) { return true; });
+    }
+
+    // normalized copy of the query in buffer if the metric needs it
+    template <typename Metric, typename T>
+    auto normalize_query(const T* query, int dim, vector<T>& buffer) {
+        if (!Metric::normalize) return query;
+        DataArray<T> row(0, dim);
+        row.append(query, 1);
+        row.normalize();
+        buffer = row.x;
+        return static_cast<const T*>(buffer.data());
+    }
+
+    enum class EntryMode {
+        // the node nearest to the centroid, plus random nodes
+        medoid,
+        random
+    };
+
+    // ids permuted so that every leaf is a contiguous range
+    struct RPTree {
+        vector<int> ids;
+        vector<pair<size_t, size_t>> leaves;
+        // leaf index of every node
+        vector<int> leaf_of;
+    };
+
+    // node order visiting neighbors before moving away, on lists that
+    // should hold both directions of every edge
+    auto bfs_order(const CandidateList& graph) {
+        const int n = graph.sizes.size();
+        vector<int> order;
+        order.reserve(n);
+        vector<char> visited(n, false);
+        for (int start = 0; start < n; ++start) {
+            if (visited[start]) continue;
+            visited[start] = true;
+            order.emplace_back(start);
+            for (auto i = order.size() - 1; i < order.size(); ++i) {
+                for (const auto id : graph[order[i]]) {
+                    if (visited[id]) continue;
+                    visited[id] = true;
+                    order.emplace_back(id);
+                }
+            }
+        }
+        return order;
+    }
+
+    auto rcm_order(const CandidateList& graph) {
+        const int n = graph.sizes.size();
+        vector<int> by_degree(n);
+        iota(by_degree.begin(), by_degree.end(), 0);
+        stable_sort(by_degree.begin(), by_degree.end(), [&](int a, int b) {
+            return graph.sizes[a] < graph.sizes[b];
+        });
+
+        vector<int> order;
+        order.reserve(n);
+        vector<char> visited(n, false);
+        vector<int> next;
+        for (const auto start : by_degree) {
+            if (visited[start]) continue;
+            visited[start] = true;
+            order.emplace_back(start);
+            for (auto i = order.size() - 1; i < order.size(); ++i) {
+                next.clear();
+                for (const auto id : graph[order[i]]) {
+                    if (visited[id]) continue;
+                    visited[id] = true;
+                    next.emplace_back(id);
+                }
+                sort(next.begin(), next.end(), [&](int a, int b) {
+                    return graph.sizes[a] < graph.sizes[b];
+                });
+                order.insert(order.end(), next.begin(), next.end());
+            }
+        }
+        reverse(order.begin(), order.end());
+        return order;
+    }
+
+    // node order placing next the node with the highest score against the
+    // last window nodes: one per edge in either direction and one per
+    // shared in-neighbor. out and in are the forward and reverse lists.
+    auto gorder_order(const CandidateList& out, const CandidateList& in,
+                      int window = 5) {
+        const int n = out.sizes.size();
+        vector<int> score(n, 0);
+        vector<char> placed(n, false);
+        // max heap of (score, id) with stale entries skipped when popped
+        priority_queue<pair<int, int>> heap;
+
+        const auto add = [&](int id, int delta) {
+            if (placed[id]) return;
+            score[id] += delta;
+            if (delta > 0) heap.emplace(score[id], id);
+        };
+        const auto update = [&](int id, int delta) {
+            for (const auto neighbor_id : out[id]) add(neighbor_id, delta);
+            for (const auto neighbor_id : in[id]) {
+                add(neighbor_id, delta);
+                for (const auto sibling_id : out[neighbor_id]) {
+                    if (sibling_id != id) add(sibling_id, delta);
+                }
+            }
+        };
+
+        vector<int> order;
+        order.reserve(n);
+        int next_unplaced = 0;
+        while (order.size() < n) {
+            int id = -1;
+            while (!heap.empty() && id < 0) {
+                const auto [entry_score, entry_id] = heap.top();
+                heap.pop();
+                if (placed[entry_id] || entry_score < score[entry_id]) continue;
+                // lowered since it was pushed
+                if (entry_score > score[entry_id]) {
+                    if (score[entry_id] > 0) heap.emplace(score[entry_id], entry_id);
+                    continue;
+                }
+                id = entry_id;
+            }
+            if (id < 0) {
+                while (placed[next_unplaced]) ++next_unplaced;
+                id = next_unplaced;
+            }
+
+            placed[id] = true;
+            order.emplace_back(id);
+            update(id, 1);
+            if (order.size() > window) update(order[order.size() - 1 - window], -1);
+        }
+        return order;
+    }
+
+    // external ids of renumbered nodes and the inverse, empty while the
+    // nodes are in input order
+    struct IdMap {
+        vector<int> external_ids, internal_ids;
+
+        auto empty() const { return external_ids.empty(); }
+
+        auto external(int id) const {
+            return external_ids.empty() ? id : external_ids[id];
+        }
+
+        auto internal(int id) const {
+            return internal_ids.empty() ? id : internal_ids[id];
+        }
+
+        auto clear() {
+            external_ids.clear();
+            internal_ids.clear();
+        }
+
+        auto assign(vector<int> external) {
+            external_ids = move(external);
+            internal_ids.assign(external_ids.size(), -1);
+            for (size_t i = 0; i < external_ids.size(); ++i) {
+                internal_ids[external_ids[i]] = i;
+            }
+        }
+
+        // node order[i] becomes node i
+        auto permute(const vector<int>& order) {
+            vector<int> external(order.size());
+            for (size_t i = 0; i < order.size(); ++i) {
+                external[i] = this->external(order[i]);
+            }
+            assign(move(external));
+        }
+    };
+
+    enum class StopReason { converged, delta, max_iterations, time_budget };
+
+    auto stop_reason_name(StopReason reason) {
+        switch (reason) {
+            case StopReason::converged: return string("converged");
+            case StopReason::delta: return string("delta");
+            case StopReason::max_iterations: return string("max_iterations");
+            case StopReason::time_budget: return string("time_budget");
+        }
+        throw runtime_error("invalid stop reason");
+    }
+
+    template <typename Metric = metric::L2, typename T = float>
     struct AKNNG {
         int n, dim, K;
-        DataArray dataset;
-        vector<multimap<float, int>> edgeset;
-        vector<unordered_map<int, bool>> added_list;
-        mt19937 engine;
+        DataArray<T> dataset;
+        EdgeSet edgeset;
+        uint64_t seed;
+        Candidates candidates;
+        // start nodes of search
+        vector<int> entry_points;
+        int n_iterations = 0;
+        StopReason stop_reason = StopReason::converged;
+        // dataset file, kept for checkpoints
+        string data_path;
+        // input order ids of the nodes after reorder(). ids taken and
+        // returned by search, remove and save are external, the rows of
+        // dataset and edgeset are internal.
+        IdMap id_map;
+        // per-thread counters of the current iteration, and the stats of
+        // all iterations of the last build
+        vector<ThreadStats> thread_stats;
+        vector<IterationStats> iteration_stats;
+        // tombstones of removed nodes, and the ones not repaired yet
+        vector<char> removed;
+        vector<int> pending;
+        int n_removed = 0;
+        // repair() compacts the graph above this ratio of removed nodes
+        float compact_ratio = 0.2;
 
-        AKNNG(int n, int dim, int K) :
+        // random streams of the build phases
+        enum Stream : uint64_t {
+            init_stream, tree_stream, sample_stream, reverse_stream,
+            entry_stream, stats_stream
+        };
+
+        AKNNG(int n, int dim, int K, uint64_t seed = 42) :
                 n(n), dim(dim), K(K),
-                dataset(n, dim), edgeset(n), added_list(n),
-                engine(42) {}
+                dataset(n, dim), edgeset(n, K),
+                seed(seed), thread_stats(omp_get_max_threads()),
+                removed(n, false) {}
 
-        auto calc_dist(DataArray::Data data_1,
-                       DataArray::Data data_2) {
-            float res = 0;
-            for (int i = 0; i < dim; ++i, ++data_1, ++data_2) {
-                float tmp = *data_1 - *data_2;
-                res += tmp * tmp;
-            }
-            return sqrt(res);
+        // a node's stream depends only on the seed, so the graph is the same
+        // for any number of threads
+        auto rng(Stream stream, uint64_t id) const {
+            return CounterRNG(seed, stream, id);
         }
 
-        auto get_neighbors_list() {
-            vector<vector<int>> neighbors_list(n);
+        auto calc_dist(typename DataArray<T>::Data data_1,
+                       typename DataArray<T>::Data data_2) {
+            return Metric::distance(data_1, data_2, dim);
+        }
 
+        // distances of data to the rows of ids into buffer.dists
+        auto calc_dists(typename DataArray<T>::Data data, const vector<int>& ids,
+                        JoinBuffer<T>& buffer) {
+            buffer.rows.resize(ids.size());
+            for (size_t i = 0; i < ids.size(); ++i) buffer.rows[i] = dataset.find(ids[i]);
+            buffer.dists.resize(ids.size());
+            Metric::distances(data, buffer.rows.data(), ids.size(), dim,
+                              buffer.dists.data());
+            local_stats().n_distances += ids.size();
+        }
+
+        auto load_dataset(const string& path) {
+            data_path = path;
+            dataset.load(data_path);
+            if (Metric::normalize) dataset.normalize();
+            id_map.clear();
+        }
+
+        // samples up to n_samples new forward neighbors per node and marks
+        // them old, adds at most max_reverse reverse neighbors of each flag,
+        // and writes the deduplicated union into the CSR candidate lists
+        auto update_candidates(int n_samples, int max_reverse) {
+            auto& c = candidates;
+            const auto n_slots = static_cast<size_t>(n) * K;
+            c.forward_new.resize(n_slots);
+            c.forward_old.resize(n_slots);
+            c.n_forward_new.assign(n, 0);
+            c.n_forward_old.assign(n, 0);
+            c.n_reverse_new.assign(n, 0);
+            c.n_reverse_old.assign(n, 0);
+
+            // forward neighbors, and the reverse degrees they imply
+#pragma omp parallel
+            {
+                vector<int> positions(K);
+#pragma omp for schedule(dynamic, 1000)
+                for (int i = 0; i < n; ++i) {
+                    auto neighbors = edgeset[i];
+                    const auto forward_new = &c.forward_new[static_cast<size_t>(i) * K];
+                    const auto forward_old = &c.forward_old[static_cast<size_t>(i) * K];
+                    auto& n_new = c.n_forward_new[i];
+                    auto& n_old = c.n_forward_old[i];
+
+                    int n_positions = 0;
+                    for (int j = 0; j < neighbors.size(); ++j) {
+                        if (neighbors[j].is_new) positions[n_positions++] = j;
+                        else forward_old[n_old++] = neighbors[j].id;
+                    }
+
+                    auto engine = rng(sample_stream,
+                                      (uint64_t(n_iterations) << 32) | i);
+                    for (int j = 0; j < min(n_samples, n_positions); ++j) {
+                        uniform_int_distribution<int> dist(j, n_positions - 1);
+                        swap(positions[j], positions[dist(engine)]);
+                        auto& neighbor = neighbors[positions[j]];
+                        neighbor.is_new = false;
+                        forward_new[n_new++] = neighbor.id;
+                    }
+
+                    for (int j = 0; j < n_new; ++j) {
+#pragma omp atomic
+                        ++c.n_reverse_new[forward_new[j]];
+                    }
+                    for (int j = 0; j < n_old; ++j) {
+#pragma omp atomic
+                        ++c.n_reverse_old[forward_old[j]];
+                    }
+                }
+            }
+
+            prefix_sum(c.n_reverse_new, c.reverse_new_offsets);
+            prefix_sum(c.n_reverse_old, c.reverse_old_offsets);
+            c.reverse_new.resize(c.reverse_new_offsets[n]);
+            c.reverse_old.resize(c.reverse_old_offsets[n]);
+
+            // scatter reverse neighbors, using the degrees as cursors
+#pragma omp parallel for schedule(dynamic, 1000)
             for (int i = 0; i < n; ++i) {
-                for (const auto& neighbor : edgeset[i]) {
-                    // add neighbor
-                    neighbors_list[i].emplace_back(neighbor.second);
-                    // add reverse neighbor
-                    neighbors_list[neighbor.second].emplace_back(i);
+                for (int j = 0; j < c.n_forward_new[i]; ++j) {
+                    const auto id = c.forward_new[static_cast<size_t>(i) * K + j];
+                    int cursor;
+#pragma omp atomic capture
+                    cursor = --c.n_reverse_new[id];
+                    c.reverse_new[c.reverse_new_offsets[id] + cursor] = i;
                 }
+                for (int j = 0; j < c.n_forward_old[i]; ++j) {
+                    const auto id = c.forward_old[static_cast<size_t>(i) * K + j];
+                    int cursor;
+#pragma omp atomic capture
+                    cursor = --c.n_reverse_old[id];
+                    c.reverse_old[c.reverse_old_offsets[id] + cursor] = i;
+                }
+            }
+
+            // rows are bounded by K forward plus max_reverse reverse ids
+            const auto row_size = static_cast<size_t>(K + max_reverse);
+            for (auto list : {&c.new_list, &c.old_list}) {
+                list->offsets.resize(n + 1);
+                list->sizes.resize(n);
+                list->ids.resize(n * row_size);
             }
 
-            return neighbors_list;
+#pragma omp parallel for schedule(dynamic, 1000)
+            for (int i = 0; i < n; ++i) {
+                c.new_list.offsets[i] = i * row_size;
+                c.old_list.offsets[i] = i * row_size;
+                auto engine = rng(reverse_stream,
+                                  (uint64_t(n_iterations) << 32) | i);
+
+                const auto fill = [&](CandidateList& list,
+                                      const int* forward, int n_forward,
+                                      int* reverse, size_t n_reverse) {
+                    // scatter order depends on threads: sort before sampling
+                    sort(reverse, reverse + n_reverse);
+                    const auto n_kept = min(n_reverse, size_t(max_reverse));
+                    for (size_t j = 0; j < n_kept; ++j) {
+                        uniform_int_distribution<size_t> dist(j, n_reverse - 1);
+                        swap(reverse[j], reverse[dist(engine)]);
+                    }
+
+                    const auto first = &list.ids[list.offsets[i]];
+                    auto last = copy(forward, forward + n_forward, first);
+                    last = copy(reverse, reverse + n_kept, last);
+                    sort(first, last);
+                    list.sizes[i] = unique(first, last) - first;
+                };
+                fill(c.new_list, &c.forward_new[static_cast<size_t>(i) * K],
+                     c.n_forward_new[i],
+                     &c.reverse_new[c.reverse_new_offsets[i]],
+                     c.reverse_new_offsets[i + 1] - c.reverse_new_offsets[i]);
+                fill(c.old_list, &c.forward_old[static_cast<size_t>(i) * K],
+                     c.n_forward_old[i],
+                     &c.reverse_old[c.reverse_old_offsets[i]],
+                     c.reverse_old_offsets[i + 1] - c.reverse_old_offsets[i]);
+            }
+            c.new_list.offsets[n] = c.old_list.offsets[n] = n * row_size;
+        }
+
+        // slots are shared only if the thread count grew after refine()
+        // last sized them
+        auto& local_stats() {
+            return thread_stats[omp_get_thread_num() % thread_stats.size()];
         }
 
         auto add_neighbor(int head_id, int tail_id) {
-            auto& added = added_list[head_id];
-            if (head_id == tail_id || added.find(tail_id) != added.end())
+            if (head_id == tail_id) return 0;
+            auto& stats = local_stats();
+            if (edgeset.contains(head_id, tail_id)) {
+                ++stats.n_duplicates;
                 return 0;
+            }
 
             const auto dist = calc_dist(
                     dataset.find(head_id), dataset.find(tail_id));
+            ++stats.n_distances;
+
+            const auto updated = edgeset.insert(head_id, dist, tail_id);
+            stats.n_updates += updated;
+            return updated;
+        }
+
+        // every node pulls the neighbors of its neighbors reached through
+        // at least one new edge and updates only its own list
+        // the neighbors of neighbors of every node are gathered without
+        // repeats and the ones not in its list yet are evaluated in one
+        // batch, in the order they were found
+        auto join_pull(const CandidateList& new_list,
+                       const CandidateList& old_list) {
+            long long int n_updated = 0;
+#pragma omp parallel
+            {
+                const auto thread_start = get_now();
+                auto& stats = local_stats();
+                JoinBuffer<T> buffer;
+                auto& ids = buffer.ids;
+                auto& visited = buffer.visited;
+                const auto gather = [&](int head_id, const IdRange& tail_ids) {
+                    for (const auto tail_id : tail_ids) {
+                        if (tail_id == head_id) continue;
+                        if (!visited.visit(tail_id) ||
+                            edgeset.contains(head_id, tail_id)) {
+                            ++stats.n_duplicates;
+                            continue;
+                        }
+                        ids.emplace_back(tail_id);
+                    }
+                };
+#pragma omp for schedule(dynamic, 1000) nowait reduction(+:n_updated)
+                for (int head_id = 0; head_id < n; ++head_id) {
+                    ids.clear();
+                    visited.clear(n);
+                    for (const auto neighbor_id_1 : new_list[head_id]) {
+                        gather(head_id, new_list[neighbor_id_1]);
+                        gather(head_id, old_list[neighbor_id_1]);
+                    }
+                    for (const auto neighbor_id_1 : old_list[head_id]) {
+                        gather(head_id, new_list[neighbor_id_1]);
+                    }
 
-            auto& neighbors = edgeset[head_id];
+                    calc_dists(dataset.find(head_id), ids, buffer);
+                    for (size_t i = 0; i < ids.size(); ++i) {
+                        const auto updated = edgeset.insert(head_id, buffer.dists[i], ids[i]);
+                        stats.n_updates += updated;
+                        n_updated += updated;
+                    }
+                }
+                stats.join_seconds += get_duration(thread_start, get_now()) / 1e6;
+            };
+            return n_updated;
+        }
 
-            if (neighbors.size() < K) {
-                neighbors.emplace(dist, tail_id);
-                added[tail_id] = true;
-                return 1;
+        // offers tail_id to the list of head_id, whose lock the caller holds
+        auto offer_neighbor(int head_id, int tail_id, float dist) {
+            auto& stats = local_stats();
+            // most offers lose against a full list, without a scan
+            const auto row = edgeset[head_id];
+            if (row.size() == K && dist >= row[K - 1].dist) return 0;
+            if (edgeset.contains(head_id, tail_id)) {
+                ++stats.n_duplicates;
+                return 0;
             }
+            const auto updated = edgeset.insert(head_id, dist, tail_id);
+            stats.n_updates += updated;
+            return updated;
+        }
 
-            const auto furthest_itr = --neighbors.cend();
-            const auto [furthest_dist, furthest_id] = *furthest_itr;
-            if (dist >= furthest_dist) return 0;
+        // locks are striped when there are fewer of them than nodes
+        auto update_neighbor(int head_id, int tail_id, float dist,
+                             vector<mutex>& locks) {
+            lock_guard<mutex> lock(locks[head_id % locks.size()]);
+            return offer_neighbor(head_id, tail_id, dist);
+        }
 
-            neighbors.emplace(dist, tail_id);
-            added[tail_id] = true;
+        auto contains(int head_id, int tail_id, vector<mutex>& locks) {
+            lock_guard<mutex> lock(locks[head_id % locks.size()]);
+            return edgeset.contains(head_id, tail_id);
+        }
 
-            if (neighbors.size() > K) {
-                neighbors.erase(furthest_itr);
-                added.erase(furthest_id);
+        // the nodes whose list includes each node, rows sorted by id
+        auto invert_candidates(const CandidateList& list, CandidateList& inverse) {
+            inverse.sizes.assign(n, 0);
+#pragma omp parallel for schedule(dynamic, 1000)
+            for (int i = 0; i < n; ++i) {
+                for (const auto id : list[i]) {
+#pragma omp atomic
+                    ++inverse.sizes[id];
+                }
             }
 
-            return 1;
+            prefix_sum(inverse.sizes, inverse.offsets);
+            inverse.ids.resize(inverse.offsets[n]);
+            // scatter using the sizes as cursors, which ends them at zero
+#pragma omp parallel for schedule(dynamic, 1000)
+            for (int i = 0; i < n; ++i) {
+                for (const auto id : list[i]) {
+                    int cursor;
+#pragma omp atomic capture
+                    cursor = --inverse.sizes[id];
+                    inverse.ids[inverse.offsets[id] + cursor] = i;
+                }
+            }
+
+#pragma omp parallel for schedule(dynamic, 1000)
+            for (int id = 0; id < n; ++id) {
+                inverse.sizes[id] = inverse.offsets[id + 1] - inverse.offsets[id];
+                sort(inverse.ids.begin() + inverse.offsets[id],
+                     inverse.ids.begin() + inverse.offsets[id + 1]);
+            }
         }
 
-        void build(const string& data_path) {
-            // init dataset
-            dataset.load(data_path);
+        // evaluates each new-new and new-old pair of candidates sharing a
+        // node once, whichever nodes they share, and offers it to both
+        // endpoints under per-node locks. one endpoint owns the pair and
+        // gathers its partners through the inverse lists without repeats;
+        // pairs already in both lists are dropped before their distance.
+        auto join_symmetric(const CandidateList& new_list,
+                            const CandidateList& old_list,
+                            vector<mutex>& locks) {
+            auto& c = candidates;
+            invert_candidates(new_list, c.new_inverse);
+            invert_candidates(old_list, c.old_inverse);
+            // alternating between the smaller and the larger id spreads the
+            // owned pairs evenly over the nodes
+            const auto owns = [](int id, int other_id) {
+                return ((id ^ other_id) & 1) ? id < other_id : id > other_id;
+            };
 
-            // init edges
-            uniform_int_distribution<int> dist(0, n - 1);
-            for (int head_id = 0; head_id < n; ++head_id) {
-                auto& neighbors = edgeset[head_id];
+            long long int n_updated = 0;
+#pragma omp parallel
+            {
+                const auto thread_start = get_now();
+                auto& stats = local_stats();
+                JoinBuffer<T> buffer;
+                auto& ids = buffer.ids;
+                auto& visited = buffer.visited;
+                const auto gather = [&](int id, const IdRange& other_ids) {
+                    for (const auto other_id : other_ids) {
+                        if (other_id == id || !owns(id, other_id)) continue;
+                        if (!visited.visit(other_id)) {
+                            ++stats.n_duplicates;
+                            continue;
+                        }
+                        ids.emplace_back(other_id);
+                    }
+                };
+#pragma omp for schedule(dynamic, 1000) nowait reduction(+:n_updated)
+                for (int id = 0; id < n; ++id) {
+                    ids.clear();
+                    visited.clear(n);
+
+                    // owned pairs already in both lists count as visited
+                    for (const auto neighbor_id : neighbor_ids(id, locks)) {
+                        if (owns(id, neighbor_id) && contains(neighbor_id, id, locks))
+                            visited.visit(neighbor_id);
+                    }
+
+                    for (const auto hub_id : c.new_inverse[id]) {
+                        gather(id, new_list[hub_id]);
+                        gather(id, old_list[hub_id]);
+                    }
+                    for (const auto hub_id : c.old_inverse[id]) {
+                        gather(id, new_list[hub_id]);
+                    }
+
+                    calc_dists(dataset.find(id), ids, buffer);
+                    {
+                        // the owner's list takes all its offers under one lock
+                        lock_guard<mutex> lock(locks[id % locks.size()]);
+                        for (size_t i = 0; i < ids.size(); ++i) {
+                            n_updated += offer_neighbor(id, ids[i], buffer.dists[i]);
+                        }
+                    }
+                    for (size_t i = 0; i < ids.size(); ++i) {
+                        n_updated += update_neighbor(ids[i], id, buffer.dists[i], locks);
+                    }
+                }
+                stats.join_seconds += get_duration(thread_start, get_now()) / 1e6;
+            };
+            return n_updated;
+        }
 
-                while (neighbors.size() < K) {
+        // fills every list up to K with uniformly random neighbors
+        auto init_random() {
+#pragma omp parallel for schedule(dynamic, 1000)
+            for (int head_id = 0; head_id < n; ++head_id) {
+                auto engine = rng(init_stream, head_id);
+                uniform_int_distribution<int> dist(0, n - 1);
+                while (edgeset.degree[head_id] < K) {
                     const auto random_id = dist(engine);
                     add_neighbor(head_id, random_id);
                 }
             }
+        }
+
+        // splits nodes recursively by the hyperplane halfway between two
+        // random nodes until at most leaf_size nodes are left
+        template <typename RNG>
+        auto build_rp_tree(int leaf_size, RNG& tree_engine) {
+            RPTree tree;
+            tree.ids.resize(n);
+            iota(tree.ids.begin(), tree.ids.end(), 0);
+            tree.leaf_of.resize(n);
+
+            vector<float> normal(dim);
+            vector<char> side(n);
+            vector<pair<size_t, size_t>> ranges{{0, n}};
+            while (!ranges.empty()) {
+                const auto [first, last] = ranges.back();
+                ranges.pop_back();
+
+                if (last - first <= leaf_size) {
+                    for (auto i = first; i < last; ++i) {
+                        tree.leaf_of[tree.ids[i]] = tree.leaves.size();
+                    }
+                    tree.leaves.emplace_back(first, last);
+                    continue;
+                }
+
+                uniform_int_distribution<size_t> dist(first, last - 1);
+                const auto left = dataset.find(tree.ids[dist(tree_engine)]);
+                const auto right = dataset.find(tree.ids[dist(tree_engine)]);
+                float offset = 0;
+                for (int j = 0; j < dim; ++j) {
+                    normal[j] = float(left[j]) - float(right[j]);
+                    offset += normal[j] * (float(left[j]) + float(right[j])) / 2;
+                }
+
+                for (auto i = first; i < last; ++i) {
+                    const auto data = dataset.find(tree.ids[i]);
+                    float margin = -offset;
+                    for (int j = 0; j < dim; ++j) margin += normal[j] * float(data[j]);
+                    // ties go to a random side so duplicates still split
+                    side[tree.ids[i]] = margin == 0 ? tree_engine() & 1 : margin > 0;
+                }
+                const auto middle = partition(
+                        tree.ids.begin() + first, tree.ids.begin() + last,
+                        [&](int id) { return side[id]; }) - tree.ids.begin();
+
+                // degenerate hyperplane: split in half instead
+                const size_t split = middle == first || middle == last ?
+                                     first + (last - first) / 2 : middle;
+                ranges.emplace_back(first, split);
+                ranges.emplace_back(split, last);
+            }
+
+            return tree;
+        }
+
+        // seeds every list with the node's leaf-mates over a forest of
+        // random projection trees built in parallel
+        auto init_rp_forest(int n_trees, int leaf_size) {
+            vector<RPTree> forest(n_trees);
+#pragma omp parallel for schedule(dynamic, 1)
+            for (int i = 0; i < n_trees; ++i) {
+                auto tree_engine = rng(tree_stream, i);
+                forest[i] = build_rp_tree(leaf_size, tree_engine);
+            }
+
+#pragma omp parallel for schedule(dynamic, 1000)
+            for (int head_id = 0; head_id < n; ++head_id) {
+                for (const auto& tree : forest) {
+                    const auto [first, last] = tree.leaves[tree.leaf_of[head_id]];
+                    for (auto i = first; i < last; ++i) {
+                        add_neighbor(head_id, tree.ids[i]);
+                    }
+                }
+            }
+        }
+
+        void build(const string& data_path, const BuildParams& params = {}) {
+            // init dataset
+            load_dataset(data_path);
+            build(params);
+        }
+
+        // builds over the rows already in dataset
+        void build(const BuildParams& params) {
+            // init edges
+            if (params.init_mode == InitMode::rp_forest)
+                init_rp_forest(params.n_trees, params.leaf_size);
+            init_random();
+
+            n_iterations = 0;
+            refine(params);
+        }
+
+        // local join of Dong et al.: a node is compared only with the
+        // neighbors of its neighbors reached through at least one new edge,
+        // i.e. new-new and new-old pairs
+        void refine(const BuildParams& params) {
+            const auto n_samples = max(1, static_cast<int>(params.rho * K));
+            const auto max_reverse = params.max_reverse > 0 ?
+                                     params.max_reverse : n_samples;
+            vector<mutex> locks(params.join_mode != JoinMode::pull ? n : 0);
+            // a resumed build reloads its rows from the dataset file
+            if (!params.checkpoint_path.empty() && data_path.empty())
+                throw runtime_error("checkpoints need rows loaded from a file");
+
+            const auto start = get_now();
+            const auto min_updated = params.delta * n * K;
+            future<void> checkpoint_writer;
+
+            auto [recall_ids, recall_expect] = sample_exact(params.recall_samples);
+            ofstream stats_sink;
+            if (!params.stats_path.empty())
+                stats_sink.open(params.stats_path,
+                                n_iterations == 0 ? ios::trunc : ios::app);
+            iteration_stats.clear();
+            thread_stats.resize(omp_get_max_threads());
 
-            auto n_itr = 0;
             while (true) {
+                fill(thread_stats.begin(), thread_stats.end(), ThreadStats());
+                IterationStats stats;
+                stats.iteration = n_iterations;
+
+                auto phase_start = get_now();
+                update_candidates(n_samples, max_reverse);
+                stats.candidates_seconds = get_duration(phase_start, get_now()) / 1e6;
+
+                phase_start = get_now();
+                const auto& new_list = candidates.new_list;
+                const auto& old_list = candidates.old_list;
+                const auto n_updated =
+                        params.join_mode == JoinMode::symmetric ?
+                        join_symmetric(new_list, old_list, locks) :
+                        join_pull(new_list, old_list);
+                stats.join_seconds = get_duration(phase_start, get_now()) / 1e6;
+                stats.n_updated = n_updated;
+
+                if (!recall_ids.empty()) {
+                    phase_start = get_now();
+                    stats.recall = sampled_recall(recall_ids, recall_expect);
+                    stats.recall_seconds = get_duration(phase_start, get_now()) / 1e6;
+                }
+                stats.elapsed_seconds = get_duration(start, get_now()) / 1e6;
+                report(stats, params, stats_sink);
+                ++n_iterations;
+
+                const auto elapsed = get_duration(start, get_now()) / 1e6;
+                bool stop = true;
+                if (n_updated <= 0)
+                    stop_reason = StopReason::converged;
+                else if (n_updated < min_updated)
+                    stop_reason = StopReason::delta;
+                else if (params.max_iterations > 0 &&
+                         n_iterations >= params.max_iterations)
+                    stop_reason = StopReason::max_iterations;
+                else if (params.time_budget > 0 &&
+                         elapsed >= params.time_budget)
+                    stop_reason = StopReason::time_budget;
+                else
+                    stop = false;
+
+                if (!stop && params.reorder != ReorderMode::none &&
+                    n_iterations == params.reorder_iteration) {
+                    const auto new_ids = reorder(params.reorder);
+                    for (auto& id : recall_ids) id = new_ids[id];
+                    for (auto& ids : recall_expect) {
+                        for (auto& id : ids) id = new_ids[id];
+                    }
+                }
+
+                if (!params.checkpoint_path.empty() &&
+                    (stop || n_iterations % params.checkpoint_interval == 0)) {
+                    // at most one write in flight
+                    if (checkpoint_writer.valid()) checkpoint_writer.get();
+                    checkpoint_writer = save_checkpoint(params);
+                }
+                if (stop) break;
+            }
+            if (checkpoint_writer.valid()) checkpoint_writer.get();
+            if (params.verbose)
+                cout << "stop: " << stop_reason_name(stop_reason) << endl;
+        }
+
+        // random nodes and their exact neighbors, for estimating recall
+        auto sample_exact(int n_samples) {
+            vector<int> ids;
+            auto engine = rng(stats_stream, 0);
+            uniform_int_distribution<int> dist(0, n - 1);
+            while (ids.size() < static_cast<size_t>(min(n_samples, n))) {
+                const auto id = dist(engine);
+                if (find(ids.begin(), ids.end(), id) == ids.end())
+                    ids.emplace_back(id);
+            }
+
+            vector<vector<int>> expect(ids.size());
+#pragma omp parallel for schedule(dynamic, 1)
+            for (int i = 0; i < ids.size(); ++i) {
+                Neighbors neighbors;
+                for (int id = 0; id < n; ++id) {
+                    if (id == ids[i]) continue;
+                    neighbors.emplace_back(calc_dist(dataset.find(ids[i]),
+                                                     dataset.find(id)), id);
+                }
+                const auto k = min<size_t>(K, neighbors.size());
+                partial_sort(neighbors.begin(), neighbors.begin() + k,
+                             neighbors.end(),
+                             [](const Neighbor& a, const Neighbor& b) {
+                                 return a.dist < b.dist;
+                             });
+                for (size_t j = 0; j < k; ++j) expect[i].emplace_back(neighbors[j].id);
+            }
+            return make_pair(ids, expect);
+        }
+
+        auto sampled_recall(const vector<int>& ids,
+                            const vector<vector<int>>& expect) {
+            long long n_found = 0, n_expected = 0;
+            for (size_t i = 0; i < ids.size(); ++i) {
+                for (const auto& neighbor : edgeset[ids[i]]) {
+                    n_found += count(expect[i].begin(), expect[i].end(),
+                                     neighbor.id);
+                }
+                n_expected += expect[i].size();
+            }
+            return n_expected > 0 ? float(n_found) / n_expected : 1.0f;
+        }
+
+        // aggregates the thread counters into stats and hands them to the
+        // enabled outputs
+        auto report(IterationStats& stats, const BuildParams& params,
+                    ofstream& stats_sink) {
+            double max_seconds = 0, total_seconds = 0;
+            for (const auto& thread : thread_stats) {
+                stats.n_distances += thread.n_distances;
+                stats.n_duplicates += thread.n_duplicates;
+                max_seconds = max(max_seconds, thread.join_seconds);
+                total_seconds += thread.join_seconds;
+            }
+            if (total_seconds > 0)
+                stats.imbalance = max_seconds * thread_stats.size() / total_seconds;
+            stats.threads = thread_stats;
+
+            if (params.verbose)
+                cout << "iteration: " << stats.iteration << ", update: " << stats.n_updated << endl;
+            if (stats_sink.is_open())
+                stats_sink << stats.to_json().dump() << '\n' << flush;
+            if (params.on_iteration) params.on_iteration(stats);
+            iteration_stats.emplace_back(move(stats));
+        }
+
+        // the random streams are derived from the seed and the iteration,
+        // so these with the lists and their flags are the whole build state
+        static constexpr uint64_t checkpoint_magic = 0x54504b4344444e4e;  // "NNDDCKPT"
+        static constexpr uint32_t checkpoint_version = 2;
+
+        // copies the lists and writes them on another thread to a temporary
+        // file, which is renamed over checkpoint_path when complete. the
+        // writer sees only copies, as the build goes on meanwhile.
+        auto save_checkpoint(const BuildParams& params) {
+            vector<Edge> pool(edgeset.edges(), edgeset.edges() + edgeset.n_slots());
+            auto degree = edgeset.degree;
+            return async(launch::async, [params, n = n, dim = dim, K = K,
+                                         seed = seed, iteration = n_iterations,
+                                         data_path = data_path,
+                                         offset = dataset.offset,
+                                         pool = move(pool),
+                                         degree = move(degree),
+                                         external_ids = id_map.external_ids]() {
+                const auto tmp_path = params.checkpoint_path + ".tmp";
+                ofstream ofs(tmp_path, ios::binary);
+                const auto write = [&](const auto& value) {
+                    ofs.write((const char*)&value, sizeof(value));
+                };
+                const auto write_string = [&](const string& value) {
+                    write(value.size());
+                    ofs.write(value.data(), value.size());
+                };
+
+                write(checkpoint_magic); write(checkpoint_version);
+                write(n); write(dim); write(K);
+                write(seed); write(iteration);
+                write_string(data_path);
+                write(offset);
+                write(params.rho); write(params.delta);
+                write(params.max_iterations); write(params.time_budget);
+                write(params.join_mode); write(params.max_reverse);
+                write(params.init_mode); write(params.n_trees);
+                write(params.leaf_size); write(params.checkpoint_interval);
+                write(params.verbose); write(params.recall_samples);
+                write_string(params.stats_path);
+                write(params.reorder); write(params.reorder_iteration);
+                ofs.write((const char*)degree.data(), degree.size() * sizeof(int));
+                ofs.write((const char*)pool.data(), pool.size() * sizeof(Edge));
+                // rows are in input order in the dataset file
+                write(external_ids.size());
+                ofs.write((const char*)external_ids.data(),
+                          external_ids.size() * sizeof(int));
+                ofs.close();
+                if (!ofs)
+                    throw runtime_error("can't write checkpoint: " + tmp_path);
+                if (rename(tmp_path.c_str(), params.checkpoint_path.c_str()) != 0)
+                    throw runtime_error("can't write checkpoint: " +
+                                        params.checkpoint_path);
+            });
+        }
+
+        // restores the dataset, lists and iteration of a checkpoint and
+        // returns the parameters it was written with
+        auto load_checkpoint(const string& checkpoint_path) {
+            ifstream ifs(checkpoint_path, ios::binary);
+            if (!ifs)
+                throw runtime_error("Can't open file!: " + checkpoint_path);
+            const auto read = [&](auto& value) {
+                ifs.read((char*)&value, sizeof(value));
+            };
+            const auto read_string = [&](string& value) {
+                size_t size = 0;
+                read(size);
+                if (!ifs || size > (size_t(1) << 20))
+                    throw runtime_error("checkpoint is truncated: " + checkpoint_path);
+                value.resize(size);
+                ifs.read(&value[0], size);
+            };
+
+            uint64_t magic = 0;
+            uint32_t version = 0;
+            int saved_n = 0, saved_dim = 0, saved_K = 0;
+            read(magic);
+            if (magic != checkpoint_magic)
+                throw runtime_error("not a checkpoint: " + checkpoint_path);
+            read(version);
+            if (version != checkpoint_version)
+                throw runtime_error("unsupported checkpoint version: " +
+                                    to_string(version));
+            read(saved_n); read(saved_dim); read(saved_K);
+            if (saved_n != n || saved_dim != dim || saved_K != K)
+                throw runtime_error("checkpoint not matched");
+
+            read(seed); read(n_iterations);
+            string path;
+            read_string(path);
+            read(dataset.offset);
+
+            BuildParams params;
+            read(params.rho); read(params.delta);
+            read(params.max_iterations); read(params.time_budget);
+            read(params.join_mode); read(params.max_reverse);
+            read(params.init_mode); read(params.n_trees);
+            read(params.leaf_size); read(params.checkpoint_interval);
+            read(params.verbose); read(params.recall_samples);
+            read_string(params.stats_path);
+            read(params.reorder); read(params.reorder_iteration);
+            ifs.read((char*)edgeset.degree.data(), n * sizeof(int));
+            ifs.read((char*)edgeset.edges(), edgeset.n_slots() * sizeof(Edge));
+            size_t n_external = 0;
+            read(n_external);
+            vector<int> external_ids(n_external);
+            ifs.read((char*)external_ids.data(), n_external * sizeof(int));
+            if (!ifs)
+                throw runtime_error("checkpoint is truncated: " + checkpoint_path);
+
+            load_dataset(path);
+            if (!external_ids.empty()) {
+                vector<T> rows(dataset.size());
+                for (int id = 0; id < n; ++id) {
+                    const auto row = dataset.find(external_ids[id]);
+                    copy(row, row + dim, rows.begin() + static_cast<size_t>(id) * dim);
+                }
+                dataset.load(move(rows));
+                id_map.assign(move(external_ids));
+            }
+            params.checkpoint_path = checkpoint_path;
+            return params;
+        }
+
+        // continues a build from its last checkpoint, with the saved
+        // parameters or with params. later checkpoints go to the same file
+        // unless params names another.
+        void resume(const string& checkpoint_path) {
+            refine(load_checkpoint(checkpoint_path));
+        }
+
+        void resume(const string& checkpoint_path, BuildParams params) {
+            load_checkpoint(checkpoint_path);
+            if (params.checkpoint_path.empty())
+                params.checkpoint_path = checkpoint_path;
+            refine(params);
+        }
+
+        // ids of a snapshot of the list of id, taken under its lock
+        auto neighbor_ids(int id, vector<mutex>& locks) {
+            lock_guard<mutex> lock(locks[id % locks.size()]);
+            vector<int> ids;
+            for (const auto& neighbor : edgeset[id]) ids.emplace_back(neighbor.id);
+            return ids;
+        }
+
+        // appends the rows of batch as new nodes, seeds their lists by
+        // searching the current graph and refines only the lists around
+        // them: each round joins the nodes updated in the previous round
+        // with the neighbors of their neighbors, so the cost follows the
+        // batch rather than n. returns the id of the first new node.
+        auto insert(DataArray<T>& batch, const InsertParams& params = {}) {
+            if (batch.dim != dim)
+                throw runtime_error("dimension not matched");
+            if (entry_points.empty()) init_entry_points();
+
+            const auto first_id = n;
+            const auto n_new = batch.n;
+            vector<T> normalized;
+            const T* rows = batch.data();
+            if (Metric::normalize) {
+                DataArray<T> copy(n_new, dim);
+                copy.load(vector<T>(rows, rows + batch.size()));
+                copy.normalize();
+                normalized = copy.x;
+                rows = normalized.data();
+            }
+            dataset.append(rows, n_new);
+            n = first_id + n_new;
+            edgeset.resize(n);
+            removed.resize(n, false);
+            if (!id_map.empty()) {
+                auto external = id_map.external_ids;
+                external.resize(n);
+                iota(external.begin() + first_id, external.end(), first_id);
+                id_map.assign(move(external));
+            }
+
+            // seed from the existing graph, whose lists only point to
+            // existing nodes until the reverse edges below are added
+#pragma omp parallel for schedule(dynamic, 16)
+            for (int id = first_id; id < n; ++id) {
+                const auto query = dataset.find(id);
+                const auto seeds = beam_search(
+                        entry_points, n, K, params.ef,
+                        [&](int tail_id) { return calc_dist(query, dataset.find(tail_id)); },
+                        [&](int head_id, const auto& offer) {
+                            for (const auto& neighbor : edgeset[head_id]) offer(neighbor.id);
+                        },
+                        [&](int tail_id) { return !removed[tail_id]; });
+                for (const auto& seed : seeds) {
+                    edgeset.insert(id, seed.dist, seed.id);
+                }
+            }
+
+            vector<mutex> locks(min(n, params.n_locks));
+            vector<int> updated;
+            const auto join = [&](int id_1, int id_2, vector<int>& heads) {
+                if (id_1 == id_2 || removed[id_1] || removed[id_2]) return 0;
+                const auto dist = calc_dist(dataset.find(id_1), dataset.find(id_2));
+                int n_updated = 0;
+                if (update_neighbor(id_1, id_2, dist, locks)) {
+                    heads.emplace_back(id_1);
+                    ++n_updated;
+                }
+                if (update_neighbor(id_2, id_1, dist, locks)) {
+                    heads.emplace_back(id_2);
+                    ++n_updated;
+                }
+                return n_updated;
+            };
+
+            // offer every new node to its seeds
+#pragma omp parallel
+            {
+                vector<int> heads;
+#pragma omp for schedule(dynamic, 16) nowait
+                for (int id = first_id; id < n; ++id) {
+                    for (const auto tail_id : neighbor_ids(id, locks)) {
+                        join(id, tail_id, heads);
+                    }
+                }
+#pragma omp critical
+                updated.insert(updated.end(), heads.begin(), heads.end());
+            }
+            for (int id = first_id; id < n; ++id) updated.emplace_back(id);
+
+            const auto min_updated = params.delta * n_new * K;
+            for (int round = 0; params.max_iterations <= 0 ||
+                                round < params.max_iterations; ++round) {
+                sort(updated.begin(), updated.end());
+                updated.erase(unique(updated.begin(), updated.end()), updated.end());
+                vector<int> active;
+                active.swap(updated);
+
                 long long int n_updated = 0;
-                const auto neighbors_list = get_neighbors_list();
 #pragma omp parallel
                 {
-#pragma omp for schedule(dynamic, 1000) nowait reduction(+:n_updated)
-                    for (int head_id = 0; head_id < n; ++head_id) {
-                        for (const auto neighbor_id_1 : neighbors_list[head_id]) {
-                            for (const auto neighbor_id_2 : neighbors_list[neighbor_id_1]) {
-                                n_updated += add_neighbor(head_id, neighbor_id_2);
+                    vector<int> heads;
+#pragma omp for schedule(dynamic, 16) nowait reduction(+:n_updated)
+                    for (int i = 0; i < active.size(); ++i) {
+                        const auto head_id = active[i];
+                        for (const auto neighbor_id : neighbor_ids(head_id, locks)) {
+                            for (const auto tail_id : neighbor_ids(neighbor_id, locks)) {
+                                n_updated += join(head_id, tail_id, heads);
                             }
                         }
                     }
-                };
-                cout << "iteration: " << n_itr << ", update: " << n_updated << endl;
-                if (n_updated <= 0) break;
-                ++n_itr;
+#pragma omp critical
+                    updated.insert(updated.end(), heads.begin(), heads.end());
+                }
+                if (params.verbose)
+                    cout << "insert round: " << round << ", update: " << n_updated << endl;
+                if (n_updated < min_updated) break;
             }
+
+            return first_id;
         }
 
-        auto save_csv(const string& save_path) {
-            ofstream ofs(save_path);
-            string line;
+        // tombstones id: it is left out of search results at once, and
+        // dropped from the lists pointing to it by the next repair()
+        auto remove(int id) {
+            if (id < 0 || id >= n)
+                throw runtime_error("invalid id: " + to_string(id));
+            id = id_map.internal(id);
+            if (removed[id]) return false;
+            removed[id] = true;
+            pending.emplace_back(id);
+            ++n_removed;
+            return true;
+        }
+
+        // drops the pending removed nodes from every live list and refills
+        // the list from the neighbors of the removed neighbors
+        auto refill() {
+            long long int n_repaired = 0;
+#pragma omp parallel for schedule(dynamic, 1000) reduction(+:n_repaired)
+            for (int head_id = 0; head_id < n; ++head_id) {
+                if (removed[head_id]) continue;
+
+                vector<int> removed_ids;
+                for (const auto& neighbor : edgeset[head_id]) {
+                    if (removed[neighbor.id]) removed_ids.emplace_back(neighbor.id);
+                }
+                if (removed_ids.empty()) continue;
+
+                // rows of removed nodes are never written here
+                edgeset.erase_if(head_id, [&](const Edge& edge) {
+                    return removed[edge.id];
+                });
+                for (const auto removed_id : removed_ids) {
+                    for (const auto& neighbor : edgeset[removed_id]) {
+                        if (removed[neighbor.id]) continue;
+                        add_neighbor(head_id, neighbor.id);
+                    }
+                }
+                ++n_repaired;
+            }
+            pending.clear();
+            return n_repaired;
+        }
+
+        // refills the lists of the pending removed nodes, then compacts the
+        // graph if the removed ratio reaches compact_ratio. returns the map
+        // from old to new ids if it compacted, else empty.
+        auto repair(bool verbose = true) {
+            if (!pending.empty()) {
+                const auto n_repaired = refill();
+                if (verbose) cout << "repair: " << n_repaired << endl;
+            }
+
+            if (n_removed > 0 && n_removed >= compact_ratio * n) return compact();
+            return vector<int>();
+        }
+
+        // renumbers the live nodes in order and rewrites the dataset and
+        // the lists without the removed nodes. returns the map from old to
+        // new ids, -1 for removed nodes.
+        auto compact() {
+            if (!pending.empty()) refill();
+
+            vector<int> new_ids(n, -1);
+            int n_live = 0;
+            for (int id = 0; id < n; ++id) {
+                if (!removed[id]) new_ids[id] = n_live++;
+            }
+
+            vector<T> rows(static_cast<size_t>(n_live) * dim);
+            EdgeSet compacted(n_live, K);
+#pragma omp parallel for schedule(dynamic, 1000)
+            for (int id = 0; id < n; ++id) {
+                const auto new_id = new_ids[id];
+                if (new_id < 0) continue;
+                copy(dataset.find(id), dataset.find(id) + dim,
+                     rows.begin() + static_cast<size_t>(new_id) * dim);
+                for (const auto& neighbor : edgeset[id]) {
+                    if (new_ids[neighbor.id] < 0) continue;
+                    compacted.insert(new_id, neighbor.dist, new_ids[neighbor.id],
+                                     neighbor.is_new);
+                }
+            }
+
+            dataset.n = n_live;
+            dataset.load(rows);
+            edgeset = move(compacted);
+            n = n_live;
+            removed.assign(n, false);
+            pending.clear();
+            n_removed = 0;
+
+            vector<int> live_entry_points;
+            for (const auto id : entry_points) {
+                if (new_ids[id] >= 0) live_entry_points.emplace_back(new_ids[id]);
+            }
+            entry_points = live_entry_points;
+            if (entry_points.empty()) init_entry_points();
+
+            if (id_map.empty()) return new_ids;
+
+            // live external ids keep their order
+            vector<int> new_external_ids(new_ids.size(), -1);
+            int n_external = 0;
+            for (const auto id : id_map.internal_ids) {
+                if (new_ids[id] >= 0) new_external_ids[id_map.external(id)] = n_external++;
+            }
+            vector<int> external(n);
+            for (int id = 0; id < new_ids.size(); ++id) {
+                if (new_ids[id] >= 0)
+                    external[new_ids[id]] = new_external_ids[id_map.external(id)];
+            }
+            id_map.assign(move(external));
+            return new_external_ids;
+        }
+
+        // renumbers the nodes so that node order[i] becomes node i, moving
+        // their rows and lists. returns the map from old to new ids.
+        auto permute(const vector<int>& order) {
+            vector<int> new_ids(n);
+            for (int i = 0; i < n; ++i) new_ids[order[i]] = i;
+
+            vector<T> rows(static_cast<size_t>(n) * dim);
+            EdgeSet permuted(n, K);
+#pragma omp parallel for schedule(dynamic, 1000)
+            for (int new_id = 0; new_id < n; ++new_id) {
+                const auto id = order[new_id];
+                copy(dataset.find(id), dataset.find(id) + dim,
+                     rows.begin() + static_cast<size_t>(new_id) * dim);
+                for (const auto& neighbor : edgeset[id]) {
+                    permuted.insert(new_id, neighbor.dist, new_ids[neighbor.id],
+                                    neighbor.is_new);
+                }
+            }
+
+            dataset.load(rows);
+            edgeset = move(permuted);
+            vector<char> permuted_removed(n);
+            for (int i = 0; i < n; ++i) permuted_removed[i] = removed[order[i]];
+            removed = move(permuted_removed);
+            for (auto& id : pending) id = new_ids[id];
+            for (auto& id : entry_points) id = new_ids[id];
+            id_map.permute(order);
+            return new_ids;
+        }
+
+        // renumbers the nodes in a locality preserving order of the graph,
+        // so that neighbors are mostly close in dataset and edgeset. the
+        // input order ids stay in id_map. returns the map from old to new
+        // internal ids.
+        auto reorder(ReorderMode mode) {
+            if (mode == ReorderMode::none) {
+                vector<int> new_ids(n);
+                iota(new_ids.begin(), new_ids.end(), 0);
+                return new_ids;
+            }
+
+            // forward and reverse lists
+            CandidateList out, in;
+            out.sizes.resize(n);
+            in.sizes.assign(n, 0);
+            for (int id = 0; id < n; ++id) {
+                out.sizes[id] = edgeset.degree[id];
+                for (const auto& neighbor : edgeset[id]) ++in.sizes[neighbor.id];
+            }
+            prefix_sum(out.sizes, out.offsets);
+            prefix_sum(in.sizes, in.offsets);
+            out.ids.resize(out.offsets[n]);
+            in.ids.resize(in.offsets[n]);
+            vector<size_t> in_filled(in.offsets.begin(), in.offsets.end() - 1);
+            for (int id = 0; id < n; ++id) {
+                auto first = out.offsets[id];
+                for (const auto& neighbor : edgeset[id]) {
+                    out.ids[first++] = neighbor.id;
+                    in.ids[in_filled[neighbor.id]++] = id;
+                }
+            }
+            if (mode == ReorderMode::gorder) return permute(gorder_order(out, in));
+
+            CandidateList both;
+            both.sizes.resize(n);
+            for (int id = 0; id < n; ++id) both.sizes[id] = out.sizes[id] + in.sizes[id];
+            prefix_sum(both.sizes, both.offsets);
+            both.ids.resize(both.offsets[n]);
+            for (int id = 0; id < n; ++id) {
+                const auto last = copy(out[id].begin(), out[id].end(),
+                                       both.ids.begin() + both.offsets[id]);
+                copy(in[id].begin(), in[id].end(), last);
+            }
+            return permute(mode == ReorderMode::bfs ? bfs_order(both) : rcm_order(both));
+        }
+
+        // merges graphs built on consecutive shards of the dataset, each
+        // loaded from shard.dataset.offset. lists start as the shard lists
+        // marked old, so pairs inside a shard are never joined again, and
+        // every node pulls a few random nodes of other shards with their
+        // neighbors as new edges before the local join runs.
+        template <typename Shard>
+        void merge(const string& data_path, vector<Shard>& shards,
+                   const BuildParams& params = {}) {
+            size_t offset = 0;
+            for (auto& shard : shards) {
+                if (shard.dataset.offset != offset)
+                    throw runtime_error("shards not matched");
+                offset += shard.n;
+            }
+            load_dataset(data_path);
+            merge(shards, params);
+        }
+
+        // merges over the rows already in dataset; only the lists of the
+        // shards are used
+        template <typename Shard>
+        void merge(vector<Shard>& shards, const BuildParams& params) {
+            vector<int> offsets{0};
+            for (auto& shard : shards) {
+                if (shard.K != K)
+                    throw runtime_error("shards not matched");
+                offsets.emplace_back(offsets.back() + shard.n);
+            }
+            if (offsets.back() != n)
+                throw runtime_error("shards not matched");
+
+            const auto shard_of = [&](int id) {
+                return upper_bound(offsets.begin(), offsets.end(), id) -
+                       offsets.begin() - 1;
+            };
+            const auto n_samples = max(1, static_cast<int>(params.rho * K));
+
+#pragma omp parallel for schedule(dynamic, 1000)
             for (int head_id = 0; head_id < n; ++head_id) {
-                for (const auto& neighbor_pair : edgeset[head_id]) {
-                    line = to_string(head_id) + ',' +
-                           to_string(neighbor_pair.second) + ',' +
-                           to_string(neighbor_pair.first);
-                    ofs << line << endl;
+                const auto shard_i = shard_of(head_id);
+                const auto first = offsets[shard_i], last = offsets[shard_i + 1];
+                for (const auto& neighbor : shards[shard_i].edgeset[head_id - first]) {
+                    edgeset.insert(head_id, neighbor.dist, neighbor.id + first, false);
                 }
+                if (last - first == n) continue;
+
+                auto engine = rng(init_stream, head_id);
+                uniform_int_distribution<int> dist(0, n - (last - first) - 1);
+                for (int i = 0; i < n_samples; ++i) {
+                    // uniform over the ids outside the shard
+                    auto random_id = dist(engine);
+                    if (random_id >= first) random_id += last - first;
+                    add_neighbor(head_id, random_id);
+
+                    const auto random_shard = shard_of(random_id);
+                    const auto random_first = offsets[random_shard];
+                    for (const auto& neighbor :
+                            shards[random_shard].edgeset[random_id - random_first]) {
+                        add_neighbor(head_id, neighbor.id + random_first);
+                    }
+                }
+            }
+
+            n_iterations = 0;
+            refine(params);
+        }
+
+        auto init_entry_points(EntryMode mode = EntryMode::medoid,
+                               int n_entries = 1) {
+            entry_points.clear();
+            if (mode == EntryMode::medoid)
+                entry_points.emplace_back(calc_medoid(dataset));
+
+            auto engine = rng(entry_stream, 0);
+            uniform_int_distribution<int> dist(0, n - 1);
+            while (entry_points.size() < min(n_entries, n)) {
+                const auto id = dist(engine);
+                if (find(entry_points.begin(), entry_points.end(), id) ==
+                    entry_points.end())
+                    entry_points.emplace_back(id);
+            }
+        }
+
+        auto search(typename DataArray<T>::Data query, int k, int ef) {
+            if (entry_points.empty()) init_entry_points();
+
+            vector<T> normalized;
+            query = normalize_query<Metric>(query, dim, normalized);
+            auto result = beam_search(
+                    entry_points, n, k, ef,
+                    [&](int id) { return calc_dist(query, dataset.find(id)); },
+                    [&](int id, const auto& offer) {
+                        for (const auto& neighbor : edgeset[id]) offer(neighbor.id);
+                    },
+                    [&](int id) { return !removed[id]; });
+            for (auto& neighbor : result) {
+                neighbor.dist = Metric::external(neighbor.dist);
+                neighbor.id = id_map.external(neighbor.id);
+            }
+            return result;
+        }
+
+        auto search(DataArray<T>& queries, int k, int ef) {
+            if (entry_points.empty()) init_entry_points();
+
+            vector<Neighbors> results(queries.n);
+#pragma omp parallel for schedule(dynamic, 16)
+            for (int i = 0; i < queries.n; ++i) {
+                results[i] = search(queries.find(i), k, ef);
+            }
+            return results;
+        }
+
+        // appends lines <head_id>,<tail_id>,<dist> of nodes [first, last),
+        // in external ids
+        auto format_csv(int first, int last, string& buffer) {
+            for (int head_id = first; head_id < last; ++head_id) {
+                for (const auto& neighbor : edgeset[id_map.internal(head_id)]) {
+                    append_number(buffer, head_id);
+                    buffer += ',';
+                    append_number(buffer, id_map.external(neighbor.id));
+                    buffer += ',';
+                    append_number(buffer, Metric::external(neighbor.dist));
+                    buffer += '\n';
+                }
+            }
+        }
+
+        // chunks of nodes are formatted in parallel and written in order
+        auto save_csv(const string& save_path) {
+            ofstream ofs(save_path);
+            if (!ofs)
+                throw runtime_error("Can't open file!: " + save_path);
+
+            const int chunk_size = 1000;
+            const int n_chunks = (n + chunk_size - 1) / chunk_size;
+#pragma omp parallel for ordered schedule(static, 1)
+            for (int i = 0; i < n_chunks; ++i) {
+                string buffer;
+                format_csv(i * chunk_size, min(n, (i + 1) * chunk_size), buffer);
+#pragma omp ordered
+                ofs.write(buffer.data(), buffer.size());
             }
         }
 
         auto save_binary(const string& save_path) {
             ofstream ofs(save_path, ios::binary);
+            vector<int> line(K + 1);
             for (int head_id = 0; head_id < n; ++head_id) {
-                // line: <K> <id_1> <id_2> ... <id_K>
-                vector<int> line{K};
-                for (const auto& neighbor_pair : edgeset[head_id]) {
-                    line.emplace_back(neighbor_pair.second);
+                // line: <degree> <id_1> <id_2> ... <id_degree>, degree <= K
+                const auto neighbors = edgeset[id_map.internal(head_id)];
+                line[0] = neighbors.size();
+                for (int i = 0; i < neighbors.size(); ++i) {
+                    line[i + 1] = id_map.external(neighbors[i].id);
                 }
-                ofs.write((char*)&line[0], (K + 1) * sizeof(int));
+                ofs.write((char*)&line[0], (line[0] + 1) * sizeof(int));
             }
         }
 
-        auto save_dir(const string& save_path) {
-            vector<string> lines(static_cast<unsigned long>(ceil(n / 1000.0)));
-            for (int head_id = 0; head_id < n; ++head_id) {
-                const size_t line_i = head_id / 1000;
-                for (const auto& neighbor_pair : edgeset[head_id]) {
-                    lines[line_i] += to_string(head_id) + "," +
-                                     to_string(neighbor_pair.second) + "," +
-                                     to_string(neighbor_pair.first) + "\n";
-                }
+        auto graph_header() const {
+            GraphHeader header{};
+            header.metric = Metric::code;
+            header.element = element_code<T>();
+            header.dim = dim;
+            header.n = n;
+            header.K = K;
+            return header;
+        }
+
+        // .graph: header, ids with internal distances and flags, degrees
+        auto save_graph(const string& save_path) {
+            if (id_map.empty()) {
+                write_graph(save_path, graph_header(), [&](size_t i) {
+                    return edgeset[i];
+                });
+                return;
             }
+            write_graph(save_path, graph_header(), [&](size_t i) {
+                const auto row = edgeset[id_map.internal(i)];
+                vector<Edge> edges(row.begin(), row.end());
+                for (auto& edge : edges) edge.id = id_map.external(edge.id);
+                return edges;
+            });
+        }
 
-            for (int i = 0; i < lines.size(); i++) {
+        // one file per 1000 nodes, each formatted and written by one thread
+        auto save_dir(const string& save_path) {
+            const int n_files = (n + 999) / 1000;
+#pragma omp parallel for schedule(dynamic, 1)
+            for (int i = 0; i < n_files; i++) {
+                string buffer;
+                format_csv(i * 1000, min(n, (i + 1) * 1000), buffer);
                 const string path = save_path + "/" + to_string(i) + ".csv";
                 ofstream ofs(path);
-                ofs << lines[i];
+                ofs.write(buffer.data(), buffer.size());
             }
         }
 
@@ -165,6 +2109,8 @@ namespace nndescent {
                 save_csv(save_path);
             else if (ends_with(".ivecs", save_path))
                 save_binary(save_path);
+            else if (ends_with(".graph", save_path))
+                save_graph(save_path);
             else if (ends_with("/", save_path))
                 save_dir(save_path);
             else
@@ -172,49 +2118,97 @@ namespace nndescent {
         }
 
         auto load_csv(const string& data_path, const string& graph_path) {
-            dataset.load(data_path);
-
-            ifstream ifs(graph_path);
-            if (!ifs) {
-                const string message = "Can't open file!: " + graph_path;
-                throw runtime_error(message);
-            }
+            load_dataset(data_path);
 
-            string line;
-            while (getline(ifs, line)) {
-                const auto row = split<float>(line);
-                auto& neighbors = edgeset[row[0]];
+            // lines are parsed in parallel and inserted in file order, so
+            // the first K lines of a node are kept
+            struct Chunk {
+                vector<Neighbor> edges;
+                vector<int> heads;
+                vector<double> fields;
+            };
+            const auto chunks = parse_lines<Chunk>(
+                    graph_path, [this](const char* first, const char* last,
+                                       Chunk& chunk) {
+                        parse_fields(first, last, chunk.fields);
+                        if (chunk.fields.size() < 3)
+                            throw runtime_error("invalid line: " + string(first, last));
+                        const int head_id = chunk.fields[0];
+                        const int tail_id = chunk.fields[1];
+                        if (head_id < 0 || head_id >= n || tail_id < 0 || tail_id >= n)
+                            throw runtime_error("invalid id: " + string(first, last));
+                        chunk.heads.emplace_back(head_id);
+                        chunk.edges.emplace_back(Metric::internal(chunk.fields[2]),
+                                                 tail_id);
+                    });
 
-                if (neighbors.size() >= K)
-                    continue;
-
-                neighbors.emplace(row[2], row[1]);
+            for (const auto& chunk : chunks) {
+                for (size_t i = 0; i < chunk.edges.size(); ++i) {
+                    const auto head_id = chunk.heads[i];
+                    if (edgeset.degree[head_id] >= K)
+                        continue;
+                    edgeset.insert(head_id, chunk.edges[i].dist, chunk.edges[i].id);
+                }
             }
         }
 
+        // ids are read row by row into the lists, whose distances are then
+        // recomputed in parallel
         auto load_binary(const string& data_path, const string& graph_path) {
-            dataset.load(data_path);
+            load_dataset(data_path);
             ifstream ifs(graph_path, ios::binary);
-            vector<vector<int>> lines;
-            while (!ifs.eof()) {
-                vector<int> line(K + 1);
-                ifs.read((char*)&line[0], (K + 1) * sizeof(int));
-                lines.emplace_back(line);
-            }
+            if (!ifs)
+                throw runtime_error("Can't open file!: " + graph_path);
 
+            vector<int> ids(K);
             for (int head_id = 0; head_id < n; ++head_id) {
-                const auto& line = lines[head_id];
-
-                if (line[0] != K)
+                int degree = 0;
+                ifs.read((char*)&degree, sizeof(int));
+                if (degree < 0 || degree > K)
                     throw runtime_error("degree not matched");
+                ifs.read((char*)ids.data(), degree * sizeof(int));
+                if (!ifs)
+                    throw runtime_error("graph has fewer rows than n");
 
-                for (int i = 1; i < K + 1; ++i) {
-                    const auto tail_id = line[i];
-                    const auto dist = calc_dist(
-                            dataset.find(head_id), dataset.find(tail_id));
-                    edgeset[head_id].emplace(dist, tail_id);
+                auto neighbors = edgeset[head_id];
+                for (int i = 0; i < degree; ++i) {
+                    if (ids[i] < 0 || ids[i] >= n)
+                        throw runtime_error("neighbor id out of range: " +
+                                            to_string(ids[i]));
+                    neighbors[i].id = ids[i];
                 }
+                edgeset.degree[head_id] = degree;
             }
+
+#pragma omp parallel for schedule(dynamic, 1000)
+            for (int head_id = 0; head_id < n; ++head_id) {
+                auto neighbors = edgeset[head_id];
+                for (auto& neighbor : neighbors) {
+                    neighbor = Edge(calc_dist(dataset.find(head_id),
+                                              dataset.find(neighbor.id)),
+                                    neighbor.id);
+                }
+                sort(neighbors.begin(), neighbors.end(),
+                     [](const Edge& a, const Edge& b) { return a.dist < b.dist; });
+            }
+        }
+
+        // maps the lists in place. the header must match this graph.
+        auto load_graph(const string& data_path, const string& graph_path,
+                        bool verify_checksum = true) {
+            auto graph = map_graph(graph_path, verify_checksum);
+            const auto expect = graph_header();
+            const auto& header = graph.header;
+            if (header.n != expect.n || header.K != expect.K ||
+                header.dim != expect.dim || header.metric != expect.metric ||
+                header.element != expect.element)
+                throw runtime_error("graph not matched: " + graph_path);
+
+            load_dataset(data_path);
+            edgeset.degree.assign(graph.degree, graph.degree + n);
+            edgeset.pool = vector<Edge>();
+            edgeset.region = graph.file;
+            edgeset.mapped = graph.edges;
         }
 
         auto load(const string& data_path, const string& graph_path) {
@@ -222,10 +2216,122 @@ namespace nndescent {
                 load_csv(data_path, graph_path);
             else if (ends_with(".ivecs", graph_path))
                 load_binary(data_path, graph_path);
+            else if (ends_with(".graph", graph_path))
+                load_graph(data_path, graph_path);
             else
                 throw runtime_error("invalid file type");
         }
     };
+
+    // lists of one shard mapped from its .graph file, without its rows,
+    // for AKNNG::merge over rows that are already loaded
+    struct GraphShard {
+        int n = 0, K = 0;
+        EdgeSet edgeset{0, 0};
+
+        GraphShard(const string& path, const GraphHeader& expect) {
+            auto graph = map_graph(path);
+            const auto& header = graph.header;
+            if (header.K != expect.K || header.dim != expect.dim ||
+                header.metric != expect.metric || header.element != expect.element)
+                throw runtime_error("graph not matched: " + path);
+
+            n = edgeset.n = header.n;
+            K = edgeset.K = header.K;
+            edgeset.degree.assign(graph.degree, graph.degree + n);
+            edgeset.region = graph.file;
+            edgeset.mapped = graph.edges;
+        }
+    };
+
+    // builds n_shards graphs over consecutive rows in forked processes, at
+    // most n_processes at a time (0 for one per processor), saves them as
+    // .graph under work_dir and merges their mapped lists in this process
+    // over one copy of the rows. a child must not use the OpenMP thread
+    // pool it inherits, whose threads do not exist after fork, so every
+    // child runs one thread and the processes provide the parallelism.
+    template <typename Metric = metric::L2, typename T = float>
+    auto build_sharded(const string& data_path, int n, int dim, int K,
+                       int n_shards, const string& work_dir,
+                       const BuildParams& params = {}, int n_processes = 0,
+                       uint64_t seed = 42) {
+        if (n_processes <= 0) n_processes = min(n_shards, omp_get_num_procs());
+
+        const auto shard_first = [&](int shard_i) {
+            return static_cast<int>(static_cast<long long>(n) * shard_i / n_shards);
+        };
+        const auto shard_path = [&](int shard_i) {
+            return work_dir + "/shard_" + to_string(shard_i) + ".graph";
+        };
+
+        // shards and pids of the running children, oldest first. only
+        // these pids are waited for, so other children of the process are
+        // left to their owners.
+        deque<pair<int, pid_t>> running;
+        vector<int> failed;
+        const auto wait_shard = [&]() {
+            const auto [shard_i, pid] = running.front();
+            running.pop_front();
+            int status = 0, result;
+            do {
+                result = waitpid(pid, &status, 0);
+            } while (result < 0 && errno == EINTR);
+            if (result != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                failed.emplace_back(shard_i);
+        };
+
+        for (int shard_i = 0; shard_i < n_shards; ++shard_i) {
+            if (running.size() >= static_cast<size_t>(n_processes)) wait_shard();
+
+            const auto pid = fork();
+            if (pid < 0) {
+                failed.emplace_back(shard_i);
+                break;
+            }
+            if (pid == 0) {
+                try {
+                    omp_set_num_threads(1);
+                    // every shard writes its own checkpoint and stats
+                    auto shard_params = params;
+                    const auto suffix = ".shard_" + to_string(shard_i);
+                    if (!shard_params.checkpoint_path.empty())
+                        shard_params.checkpoint_path += suffix;
+                    if (!shard_params.stats_path.empty())
+                        shard_params.stats_path += suffix;
+
+                    const auto first = shard_first(shard_i);
+                    AKNNG<Metric, T> shard(shard_first(shard_i + 1) - first,
+                                           dim, K, seed + shard_i);
+                    shard.dataset.offset = first;
+                    shard.build(data_path, shard_params);
+                    shard.save(shard_path(shard_i));
+                    _exit(0);
+                } catch (...) {
+                    _exit(1);
+                }
+            }
+            running.emplace_back(shard_i, pid);
+        }
+        while (!running.empty()) wait_shard();
+        if (!failed.empty()) {
+            string shard_ids;
+            for (const auto shard_i : failed) {
+                shard_ids += (shard_ids.empty() ? "" : ", ") + to_string(shard_i);
+            }
+            throw runtime_error("shard build failed: " + shard_ids);
+        }
+
+        AKNNG<Metric, T> aknng(n, dim, K, seed);
+        vector<GraphShard> shards;
+        for (int shard_i = 0; shard_i < n_shards; ++shard_i) {
+            shards.emplace_back(shard_path(shard_i), aknng.graph_header());
+            if (shards.back().n != shard_first(shard_i + 1) - shard_first(shard_i))
+                throw runtime_error("graph not matched: " + shard_path(shard_i));
+        }
+        aknng.load_dataset(data_path);
+        aknng.merge(shards, params);
+        return aknng;
+    }
 }
 
 #endif //NNDESCENT_NNDESCENT_HPP
@@ -0,0 +1,429 @@
+#ifndef NNDESCENT_OUT_OF_CORE_HPP
+#define NNDESCENT_OUT_OF_CORE_HPP
+
+#include <nndescent.hpp>
+#include <future>
+#include <map>
+#include <set>
+
+using namespace std;
+using namespace cpputil;
+
+namespace nndescent {
+    struct OutOfCoreParams {
+        // bytes of blocks and join state resident at once
+        size_t memory_budget = size_t(1) << 30;
+        // local directory in which every build makes its own directory
+        // for the block files
+        string work_dir = "/tmp";
+        // blocks newly merged with every block per round, which bounds a
+        // round to n_blocks * merge_fanout / 2 pair merges
+        int merge_fanout = 2;
+        // round cap. rounds also stop when one updates fewer than
+        // build_params.delta * n * K edges.
+        int max_rounds = 4;
+        BuildParams build_params;
+    };
+
+    // rows and lists of one block. list ids are global.
+    template <typename T>
+    struct Block {
+        int id = -1, first = 0, n = 0;
+        vector<T> rows;
+        vector<Edge> pool;
+        vector<int> degree;
+    };
+
+    // builds the graph with only a few blocks of consecutive rows resident:
+    // every block is built alone, then rounds merge every block with a few
+    // blocks it was not merged with while the next block is read ahead on
+    // another thread. the lists live in one file per block between the steps,
+    // in a directory that is removed with the graph.
+    template <typename Metric = metric::L2, typename T = float>
+    struct OutOfCoreAKNNG {
+        int n, dim, K;
+        uint64_t seed;
+        int block_size = 0, n_blocks = 0;
+        // directory of the block files of the last build
+        string work_dir;
+        // pair merges of the last build
+        size_t n_merges = 0;
+
+        OutOfCoreAKNNG(int n, int dim, int K, uint64_t seed = 42) :
+                n(n), dim(dim), K(K), seed(seed) {}
+
+        // a copy would remove the block files of the original
+        OutOfCoreAKNNG(const OutOfCoreAKNNG&) = delete;
+        OutOfCoreAKNNG& operator=(const OutOfCoreAKNNG&) = delete;
+
+        ~OutOfCoreAKNNG() {
+            remove_blocks();
+        }
+
+        // resident bytes per block row while two blocks are merged. rows:
+        // the first block's buffer holding both blocks, the second block
+        // until it is moved there, and the prefetched block with room for
+        // two. lists: the three blocks, and for both rows of the pair the
+        // shard and pair lists with the removed flags, the candidates and
+        // their inverse, the locks and the visited marks of every thread.
+        auto bytes_per_row(const BuildParams& params = {}) const {
+            const size_t row = dim * sizeof(T);
+            const size_t list = K * sizeof(Edge) + sizeof(int);
+            const auto n_samples = max(1, static_cast<int>(params.rho * K));
+            const auto max_reverse = params.max_reverse > 0 ?
+                                     params.max_reverse : n_samples;
+            // forward and reverse ids of both flags, the two capped lists,
+            // their sizes and offsets, and the counts and reverse offsets
+            const size_t candidates = (6 * K + 2 * max_reverse + 6) * sizeof(int) +
+                                      4 * sizeof(size_t);
+            const size_t lock = params.join_mode != JoinMode::pull ? sizeof(mutex) : 0;
+            // the inverse of both capped lists
+            const size_t inverse = params.join_mode == JoinMode::symmetric ?
+                                   (2 * K + 2 * max_reverse + 2) * sizeof(int) +
+                                   2 * sizeof(size_t) : 0;
+            const size_t visited = omp_get_max_threads() * sizeof(uint32_t);
+            return 5 * row + 3 * list +
+                   2 * (2 * (list + sizeof(char)) + candidates + inverse + lock + visited);
+        }
+
+        auto block_first(int block_i) const {
+            return min(n, block_i * block_size);
+        }
+
+        auto block_path(int block_i, const string& suffix) const {
+            return work_dir + "/block_" + to_string(block_i) + suffix;
+        }
+
+        auto remove_blocks() {
+            if (work_dir.empty()) return;
+            for (int block_i = 0; block_i < n_blocks; ++block_i) {
+                unlink(block_path(block_i, ".data").c_str());
+                unlink(block_path(block_i, ".edges").c_str());
+            }
+            rmdir(work_dir.c_str());
+            work_dir.clear();
+        }
+
+        auto write_rows(int block_i, const T* rows, size_t n_rows) const {
+            ofstream ofs(block_path(block_i, ".data"), ios::binary);
+            ofs.write((char*)rows, n_rows * dim * sizeof(T));
+            if (!ofs)
+                throw runtime_error("can't write block: " + to_string(block_i));
+        }
+
+        auto write_block(const Block<T>& block) const {
+            ofstream ofs(block_path(block.id, ".edges"), ios::binary);
+            ofs.write((char*)block.degree.data(), block.n * sizeof(int));
+            ofs.write((char*)block.pool.data(), block.pool.size() * sizeof(Edge));
+            if (!ofs)
+                throw runtime_error("can't write block: " + to_string(block.id));
+        }
+
+        // the rows of a block read as the first of a pair get room for the
+        // second block's rows
+        auto read_block(int block_i, bool first_of_pair = false) const {
+            Block<T> block;
+            block.id = block_i;
+            block.first = block_first(block_i);
+            block.n = block_first(block_i + 1) - block.first;
+            if (first_of_pair) block.rows.reserve(2 * static_cast<size_t>(block_size) * dim);
+            block.rows.resize(static_cast<size_t>(block.n) * dim);
+            block.degree.resize(block.n);
+            block.pool.resize(static_cast<size_t>(block.n) * K);
+
+            ifstream data(block_path(block_i, ".data"), ios::binary);
+            data.read((char*)block.rows.data(), block.rows.size() * sizeof(T));
+            ifstream edges(block_path(block_i, ".edges"), ios::binary);
+            edges.read((char*)block.degree.data(), block.n * sizeof(int));
+            edges.read((char*)block.pool.data(), block.pool.size() * sizeof(Edge));
+            if (!data || !edges)
+                throw runtime_error("can't read block: " + to_string(block_i));
+            return block;
+        }
+
+        // loads the rows of every block from the dataset, builds its graph
+        // and writes both to work_dir. the rows are written straight from
+        // the dataset.
+        auto build_blocks(const string& data_path, const BuildParams& params) {
+            for (int block_i = 0; block_i < n_blocks; ++block_i) {
+                // every block writes its own checkpoint and stats
+                auto block_params = params;
+                const auto suffix = ".block_" + to_string(block_i);
+                if (!block_params.checkpoint_path.empty())
+                    block_params.checkpoint_path += suffix;
+                if (!block_params.stats_path.empty())
+                    block_params.stats_path += suffix;
+
+                const auto first = block_first(block_i);
+                AKNNG<Metric, T> graph(block_first(block_i + 1) - first, dim, K,
+                                       seed + block_i);
+                graph.dataset.offset = first;
+                graph.build(data_path, block_params);
+
+                Block<T> block;
+                block.id = block_i;
+                block.first = first;
+                block.n = graph.n;
+                block.degree = move(graph.edgeset.degree);
+                block.pool = move(graph.edgeset.pool);
+                for (auto& edge : block.pool) edge.id += first;
+                write_rows(block_i, graph.dataset.data(), graph.n);
+                write_block(block);
+            }
+        }
+
+        // merges the lists of two blocks that were not merged yet: the
+        // edges inside each block seed AKNNG::merge, and the edges into
+        // other blocks are kept and compete with the merged ones. returns
+        // the edges between the two blocks, which are all new.
+        auto merge_blocks(Block<T>& block_1, Block<T>& block_2,
+                          const BuildParams& params) {
+            const auto n_pair = block_1.n + block_2.n;
+            const auto pair_seed = mix64(seed + n_blocks + block_1.id * n_blocks +
+                                         block_2.id);
+            AKNNG<Metric, T> graph(n_pair, dim, K, pair_seed);
+            // the second block's rows are appended to the first block's
+            // buffer, which has room for them, and the pair's dataset takes
+            // the buffer until the merge is done
+            auto rows = move(block_1.rows);
+            rows.insert(rows.end(), block_2.rows.begin(), block_2.rows.end());
+            vector<T>().swap(block_2.rows);
+            graph.dataset.load(move(rows));
+
+            vector<AKNNG<Metric, T>> shards;
+            for (auto block : {&block_1, &block_2}) {
+                shards.emplace_back(block->n, dim, K);
+                auto& shard = shards.back();
+                for (int i = 0; i < block->n; ++i) {
+                    const auto row = &block->pool[static_cast<size_t>(i) * K];
+                    for (int j = 0; j < block->degree[i]; ++j) {
+                        const auto id = row[j].id - block->first;
+                        if (id < 0 || id >= block->n) continue;
+                        shard.edgeset.insert(i, row[j].dist, id, false);
+                    }
+                }
+            }
+            // the pair's rows are not in a file the merge could be resumed
+            // from, so it takes no checkpoint, and it writes its own stats
+            auto pair_params = params;
+            pair_params.checkpoint_path.clear();
+            if (!pair_params.stats_path.empty()) {
+                pair_params.stats_path += ".blocks_" + to_string(block_1.id) + "_" +
+                                          to_string(block_2.id);
+            }
+            graph.merge(shards, pair_params);
+
+            size_t updates = 0;
+#pragma omp parallel reduction(+:updates)
+            {
+                // one list per thread collects the merged row
+                EdgeSet merged(1, K);
+#pragma omp for schedule(dynamic, 1000)
+                for (int local_id = 0; local_id < n_pair; ++local_id) {
+                    auto& block = local_id < block_1.n ? block_1 : block_2;
+                    const auto i = local_id < block_1.n ? local_id : local_id - block_1.n;
+                    const auto row = &block.pool[static_cast<size_t>(i) * K];
+
+                    merged.degree[0] = 0;
+                    for (int j = 0; j < block.degree[i]; ++j) {
+                        const auto id = row[j].id;
+                        if (id >= block.first && id < block.first + block.n) continue;
+                        merged.insert(0, row[j].dist, id, false);
+                    }
+                    for (const auto& edge : graph.edgeset[local_id]) {
+                        const auto id = edge.id < block_1.n ?
+                                        block_1.first + edge.id :
+                                        block_2.first + edge.id - block_1.n;
+                        merged.insert(0, edge.dist, id, false);
+                    }
+                    copy(merged.pool.begin(), merged.pool.end(), row);
+                    block.degree[i] = merged.degree[0];
+
+                    const auto& other = &block == &block_1 ? block_2 : block_1;
+                    for (int j = 0; j < block.degree[i]; ++j) {
+                        updates += row[j].id >= other.first &&
+                                   row[j].id < other.first + other.n;
+                    }
+                }
+            }
+
+            block_1.rows = move(graph.dataset.x);
+            block_1.rows.resize(static_cast<size_t>(block_1.n) * dim);
+            return updates;
+        }
+
+        // pairs of a round in row-major order: every block takes up to
+        // fanout blocks it was not merged with, first the blocks that its
+        // merged blocks were merged with, weighted by the edges between
+        // them, then random blocks
+        auto schedule_round(int round, int fanout,
+                            const vector<map<int, size_t>>& links,
+                            set<pair<int, int>>& merged) const {
+            auto engine = CounterRNG(seed, n_blocks, round);
+            vector<int> order(n_blocks), n_partners(n_blocks, 0);
+            iota(order.begin(), order.end(), 0);
+            shuffle(order.begin(), order.end(), engine);
+
+            vector<pair<int, int>> pairs;
+            for (const auto i : order) {
+                map<int, size_t> scores;
+                for (const auto& [k, w_ik] : links[i]) {
+                    for (const auto& [j, w_kj] : links[k]) scores[j] += min(w_ik, w_kj);
+                }
+                vector<pair<size_t, int>> ranked;
+                for (const auto& [j, score] : scores) ranked.emplace_back(score, j);
+                sort(ranked.rbegin(), ranked.rend());
+
+                vector<int> candidates;
+                for (const auto& [score, j] : ranked) candidates.emplace_back(j);
+                for (int attempt = 0; attempt < 4 * fanout; ++attempt) {
+                    candidates.emplace_back(engine() % n_blocks);
+                }
+                for (const auto j : candidates) {
+                    if (n_partners[i] >= fanout) break;
+                    if (j == i || n_partners[j] >= fanout) continue;
+                    if (!merged.emplace(min(i, j), max(i, j)).second) continue;
+                    pairs.emplace_back(min(i, j), max(i, j));
+                    ++n_partners[i];
+                    ++n_partners[j];
+                }
+            }
+            sort(pairs.begin(), pairs.end());
+            return pairs;
+        }
+
+        // merges the pairs in order with the first block kept resident
+        // while its pairs last. returns the edges between merged blocks.
+        auto merge_round(const vector<pair<int, int>>& pairs,
+                         vector<map<int, size_t>>& links,
+                         const OutOfCoreParams& params) {
+            // reads the block of the next pair that is not resident, unless
+            // it is the second block of the current pair, whose file is
+            // written only after the merge
+            const auto prefetch = [&](size_t pair_i) {
+                if (pair_i >= pairs.size()) return future<Block<T>>();
+                const auto [i, j] = pairs[pair_i];
+                const auto block_i = pairs[pair_i - 1].first == i ? j : i;
+                if (block_i == pairs[pair_i - 1].second) return future<Block<T>>();
+                const auto first_of_pair = block_i == i;
+                return async(launch::async, [this, block_i, first_of_pair]() {
+                    return read_block(block_i, first_of_pair);
+                });
+            };
+            const auto take = [&](future<Block<T>>& next, int block_i,
+                                  bool first_of_pair) {
+                if (next.valid()) {
+                    auto block = next.get();
+                    if (block.id == block_i) return block;
+                }
+                return read_block(block_i, first_of_pair);
+            };
+
+            size_t updates = 0;
+            Block<T> block_1;
+            future<Block<T>> next;
+            for (size_t pair_i = 0; pair_i < pairs.size(); ++pair_i) {
+                const auto [i, j] = pairs[pair_i];
+                if (block_1.id != i) {
+                    if (block_1.id >= 0) write_block(block_1);
+                    // freed before the next first block is taken
+                    block_1 = Block<T>();
+                    block_1 = take(next, i, true);
+                }
+                auto block_2 = take(next, j, false);
+                next = prefetch(pair_i + 1);
+
+                const auto pair_updates = merge_blocks(block_1, block_2,
+                                                       params.build_params);
+                write_block(block_2);
+                links[i][j] = links[j][i] = pair_updates;
+                updates += pair_updates;
+                ++n_merges;
+                if (params.build_params.verbose)
+                    cout << "merged blocks: " << i << ", " << j << endl;
+            }
+            if (next.valid()) next.wait();
+            if (block_1.id >= 0) write_block(block_1);
+            return updates;
+        }
+
+        void build(const string& data_path, const OutOfCoreParams& params = {}) {
+            // concurrent builds in the same work_dir get their own directory
+            remove_blocks();
+            auto dir = params.work_dir + "/nndescent_blocks_XXXXXX";
+            if (!mkdtemp(dir.data()))
+                throw runtime_error("can't create block directory in: " + params.work_dir);
+            work_dir = dir;
+
+            block_size = max<size_t>(K + 1, params.memory_budget /
+                                            bytes_per_row(params.build_params));
+            if (block_size >= n) block_size = n;
+            n_blocks = (n + block_size - 1) / block_size;
+            if (params.build_params.verbose)
+                cout << "blocks: " << n_blocks << ", block size: " << block_size << endl;
+
+            build_blocks(data_path, params.build_params);
+
+            // the block graph: edges between merged blocks
+            vector<map<int, size_t>> links(n_blocks);
+            set<pair<int, int>> merged;
+            n_merges = 0;
+            for (int round = 0; round < params.max_rounds; ++round) {
+                const auto pairs = schedule_round(round, params.merge_fanout,
+                                                  links, merged);
+                if (pairs.empty()) break;
+                const auto updates = merge_round(pairs, links, params);
+                if (params.build_params.verbose) {
+                    cout << "round: " << round << ", pairs: " << pairs.size()
+                         << ", updates: " << updates << endl;
+                }
+                if (updates < params.build_params.delta * n * K) break;
+            }
+        }
+
+        // lists of all nodes, streamed block by block through callback(id, row)
+        template <typename Callback>
+        auto for_each_list(const Callback& callback) const {
+            for (int block_i = 0; block_i < n_blocks; ++block_i) {
+                auto block = read_block(block_i);
+                for (int i = 0; i < block.n; ++i) {
+                    callback(block.first + i,
+                             EdgeRow(&block.pool[static_cast<size_t>(i) * K],
+                                     block.degree[i]));
+                }
+            }
+        }
+
+        void save(const string& save_path) const {
+            if (is_csv(save_path)) {
+                ofstream ofs(save_path);
+                string buffer;
+                for_each_list([&](int head_id, const EdgeRow& row) {
+                    buffer.clear();
+                    for (const auto& neighbor : row) {
+                        append_number(buffer, head_id);
+                        buffer += ',';
+                        append_number(buffer, neighbor.id);
+                        buffer += ',';
+                        append_number(buffer, Metric::external(neighbor.dist));
+                        buffer += '\n';
+                    }
+                    ofs.write(buffer.data(), buffer.size());
+                });
+            } else if (ends_with(".ivecs", save_path)) {
+                ofstream ofs(save_path, ios::binary);
+                vector<int> line(K + 1);
+                for_each_list([&](int, const EdgeRow& row) {
+                    // line: <degree> <id_1> <id_2> ... <id_degree>, degree <= K
+                    line[0] = row.size();
+                    for (int i = 0; i < line[0]; ++i) line[i + 1] = row[i].id;
+                    ofs.write((char*)&line[0], (line[0] + 1) * sizeof(int));
+                });
+            } else {
+                throw runtime_error("invalid file type");
+            }
+        }
+    };
+}
+
+#endif //NNDESCENT_OUT_OF_CORE_HPP
@@ -0,0 +1,342 @@
+#ifndef NNDESCENT_SEARCH_GRAPH_HPP
+#define NNDESCENT_SEARCH_GRAPH_HPP
+
+#include <nndescent.hpp>
+
+using namespace std;
+using namespace cpputil;
+
+namespace nndescent {
+    struct PruneParams {
+        // a candidate is dropped when a kept neighbor is alpha times closer
+        // to it than the node itself. 1 gives the relative neighborhood
+        // graph, larger values keep more long-range edges.
+        float alpha = 1.2;
+        int max_degree = 32;
+        // add the reverse of every kept edge, pruning again when a node
+        // exceeds max_degree
+        bool add_reverse = true;
+        // print the number of linked nodes to stdout
+        bool verbose = true;
+    };
+
+    // variable degree graph pruned from a k-nn graph, searched from the
+    // medoid. alpha pruning assumes a metric distance.
+    template <typename Metric = metric::L2, typename T = float>
+    struct SearchGraph {
+        int n, dim;
+        DataArray<T> dataset;
+        // neighbors of each node, sorted by distance
+        vector<vector<int>> adjacency;
+        int entry_point = 0;
+        // input order ids of a reordered graph, as in AKNNG
+        IdMap id_map;
+
+        SearchGraph(int n, int dim) :
+                n(n), dim(dim), dataset(n, dim), adjacency(n) {}
+
+        auto calc_dist(typename DataArray<T>::Data data_1,
+                       typename DataArray<T>::Data data_2) {
+            return Metric::distance(data_1, data_2, dim);
+        }
+
+        auto calc_dist(int id_1, int id_2) {
+            return calc_dist(dataset.find(id_1), dataset.find(id_2));
+        }
+
+        // occlusion pruning of candidates sorted by distance to head_id:
+        // a candidate is kept unless a closer kept neighbor occludes it
+        auto prune(int head_id, const Neighbors& candidates, float alpha,
+                   int max_degree) {
+            vector<int> kept;
+            for (const auto& candidate : candidates) {
+                if (kept.size() >= max_degree) break;
+                if (candidate.id == head_id) continue;
+
+                const auto dist = Metric::external(candidate.dist);
+                bool occluded = false;
+                for (const auto id : kept) {
+                    if (id == candidate.id ||
+                        alpha * Metric::external(calc_dist(id, candidate.id)) <= dist) {
+                        occluded = true;
+                        break;
+                    }
+                }
+                if (!occluded) kept.emplace_back(candidate.id);
+            }
+            return kept;
+        }
+
+        // union of the forward and reverse neighbors of head_id, pruned
+        // again if it exceeds max_degree
+        auto merge_reverse(int head_id, const vector<int>& reverse,
+                           const PruneParams& params) {
+            auto& neighbors = adjacency[head_id];
+            Neighbors candidates;
+            for (const auto id : neighbors) {
+                candidates.emplace_back(calc_dist(head_id, id), id);
+            }
+            for (const auto id : reverse) {
+                if (find(neighbors.begin(), neighbors.end(), id) != neighbors.end())
+                    continue;
+                candidates.emplace_back(calc_dist(head_id, id), id);
+            }
+            sort_neighbors(candidates);
+
+            if (candidates.size() > params.max_degree) {
+                neighbors = prune(head_id, candidates, params.alpha,
+                                  params.max_degree);
+                return;
+            }
+            neighbors.clear();
+            for (const auto& candidate : candidates) {
+                neighbors.emplace_back(candidate.id);
+            }
+        }
+
+        // inserts tail_id into the neighbors of head_id in sorted position,
+        // pruning them as merge_reverse() does past max_degree unless
+        // allow_prune is false. returns whether they were pruned.
+        auto link(int head_id, int tail_id, const PruneParams& params,
+                  bool allow_prune = true) {
+            auto link_params = params;
+            if (!allow_prune) link_params.max_degree = numeric_limits<int>::max();
+            const auto degree = adjacency[head_id].size();
+            merge_reverse(head_id, {tail_id}, link_params);
+            return adjacency[head_id].size() <= degree;
+        }
+
+        // marks the nodes reachable from start that are not marked yet
+        auto mark_reachable(int start, vector<char>& reached) {
+            vector<int> queue{start};
+            reached[start] = true;
+            for (size_t i = 0; i < queue.size(); ++i) {
+                for (const auto id : adjacency[queue[i]]) {
+                    if (reached[id]) continue;
+                    reached[id] = true;
+                    queue.emplace_back(id);
+                }
+            }
+        }
+
+        // links every live node unreachable from the entry point to its
+        // nearest reachable node, found by searching from the entry point.
+        // a link that prunes a full node may cut off nodes reached through
+        // it, so passes repeat while they prune. the last of max_passes
+        // links without pruning, which may leave a few nodes above
+        // max_degree but none unreachable.
+        auto connect(const vector<char>& removed, const PruneParams& params,
+                     int max_passes = 4) {
+            int n_linked = 0;
+            bool pruned = true;
+            for (int pass = 0; pruned && pass < max_passes; ++pass) {
+                pruned = false;
+                const auto allow_prune = pass + 1 < max_passes;
+                // removed nodes count as reached and are never linked
+                auto reached = removed;
+                mark_reachable(entry_point, reached);
+                for (int id = 0; id < n; ++id) {
+                    if (reached[id]) continue;
+                    // the nearest reached node with room for the link, or
+                    // the nearest one pruned to make room
+                    const auto nearest = search_internal(dataset.find(id),
+                                                         params.max_degree,
+                                                         params.max_degree);
+                    auto head_id = nearest[0].id;
+                    for (const auto& neighbor : nearest) {
+                        if (adjacency[neighbor.id].size() >= params.max_degree)
+                            continue;
+                        head_id = neighbor.id;
+                        break;
+                    }
+                    pruned = link(head_id, id, params, allow_prune) || pruned;
+                    mark_reachable(id, reached);
+                    ++n_linked;
+                }
+            }
+            return n_linked;
+        }
+
+        // removed nodes of the graph keep no edges and are never linked
+        template <typename Graph>
+        void build(Graph& aknng, const PruneParams& params = {}) {
+            if (aknng.n != n || aknng.dim != dim)
+                throw runtime_error("graph not matched");
+            dataset = aknng.dataset;
+            id_map = aknng.id_map;
+            const auto& removed = aknng.removed;
+
+            // occlusion pruning of the k-nn lists
+#pragma omp parallel for schedule(dynamic, 1000)
+            for (int head_id = 0; head_id < n; ++head_id) {
+                Neighbors candidates;
+                if (!removed[head_id]) {
+                    for (const auto& neighbor : aknng.edgeset[head_id]) {
+                        if (removed[neighbor.id]) continue;
+                        candidates.emplace_back(neighbor.dist, neighbor.id);
+                    }
+                }
+                adjacency[head_id] = prune(head_id, candidates, params.alpha,
+                                           params.max_degree);
+            }
+
+            if (params.add_reverse) {
+                vector<vector<int>> reverse(n);
+                for (int head_id = 0; head_id < n; ++head_id) {
+                    for (const auto id : adjacency[head_id]) {
+                        reverse[id].emplace_back(head_id);
+                    }
+                }
+
+#pragma omp parallel for schedule(dynamic, 1000)
+                for (int head_id = 0; head_id < n; ++head_id) {
+                    merge_reverse(head_id, reverse[head_id], params);
+                }
+            }
+
+            entry_point = calc_medoid(dataset, removed);
+            const auto n_linked = connect(removed, params);
+            if (params.verbose) cout << "pruned, linked: " << n_linked << endl;
+        }
+
+        auto search_internal(typename DataArray<T>::Data query, int k, int ef) {
+            return beam_search(
+                    vector<int>{entry_point}, n, k, ef,
+                    [&](int id) { return calc_dist(query, dataset.find(id)); },
+                    [&](int id, const auto& offer) {
+                        for (const auto neighbor_id : adjacency[id]) offer(neighbor_id);
+                    });
+        }
+
+        auto search(typename DataArray<T>::Data query, int k, int ef) {
+            vector<T> normalized;
+            query = normalize_query<Metric>(query, dim, normalized);
+            auto result = search_internal(query, k, ef);
+            for (auto& neighbor : result) {
+                neighbor.dist = Metric::external(neighbor.dist);
+                neighbor.id = id_map.external(neighbor.id);
+            }
+            return result;
+        }
+
+        auto search(DataArray<T>& queries, int k, int ef) {
+            vector<Neighbors> results(queries.n);
+#pragma omp parallel for schedule(dynamic, 16)
+            for (int i = 0; i < queries.n; ++i) {
+                results[i] = search(queries.find(i), k, ef);
+            }
+            return results;
+        }
+
+        auto n_edges() const {
+            size_t total = 0;
+            for (const auto& neighbors : adjacency) total += neighbors.size();
+            return total;
+        }
+
+        auto max_degree() const {
+            size_t result = 0;
+            for (const auto& neighbors : adjacency) result = max(result, neighbors.size());
+            return result;
+        }
+
+        // .graph with K = max_degree(), or .ivecs lines of
+        // <degree> <id_1> <id_2> ... <id_degree>, in external ids
+        void save(const string& save_path) {
+            if (ends_with(".graph", save_path)) {
+                GraphHeader header{};
+                header.metric = Metric::code;
+                header.element = element_code<T>();
+                header.dim = dim;
+                header.n = n;
+                header.K = max_degree();
+                write_graph(save_path, header, [&](size_t i) {
+                    const auto head_id = id_map.internal(i);
+                    vector<Edge> row;
+                    for (const auto id : adjacency[head_id]) {
+                        row.emplace_back(calc_dist(head_id, id),
+                                         id_map.external(id), false);
+                    }
+                    return row;
+                });
+                return;
+            }
+            if (!ends_with(".ivecs", save_path))
+                throw runtime_error("invalid file type");
+
+            ofstream ofs(save_path, ios::binary);
+            vector<int> line;
+            for (int i = 0; i < n; ++i) {
+                // line: <degree> <id_1> <id_2> ... <id_degree>
+                line.assign(1, adjacency[id_map.internal(i)].size());
+                for (const auto id : adjacency[id_map.internal(i)]) {
+                    line.emplace_back(id_map.external(id));
+                }
+                ofs.write((char*)line.data(), line.size() * sizeof(int));
+            }
+        }
+
+        // nodes without edges in either direction, which are the removed
+        // nodes of the graph build() pruned
+        auto isolated() const {
+            vector<char> result(n, true);
+            for (int head_id = 0; head_id < n; ++head_id) {
+                if (!adjacency[head_id].empty()) result[head_id] = false;
+                for (const auto id : adjacency[head_id]) result[id] = false;
+            }
+            return result;
+        }
+
+        void load(const string& data_path, const string& graph_path) {
+            dataset.load(data_path);
+            if (Metric::normalize) dataset.normalize();
+            id_map.clear();
+
+            if (ends_with(".graph", graph_path)) {
+                const auto graph = map_graph(graph_path);
+                const auto& header = graph.header;
+                if (header.n != n || header.dim != dim ||
+                    header.metric != Metric::code ||
+                    header.element != element_code<T>())
+                    throw runtime_error("graph not matched: " + graph_path);
+                for (int head_id = 0; head_id < n; ++head_id) {
+                    const auto row = graph.edges + head_id * header.K;
+                    auto& neighbors = adjacency[head_id];
+                    neighbors.clear();
+                    for (int i = 0; i < graph.degree[head_id]; ++i) {
+                        neighbors.emplace_back(row[i].id);
+                    }
+                }
+                entry_point = calc_medoid(dataset, isolated());
+                return;
+            }
+            if (!ends_with(".ivecs", graph_path))
+                throw runtime_error("invalid file type");
+
+            ifstream ifs(graph_path, ios::binary);
+            if (!ifs)
+                throw runtime_error("Can't open file!: " + graph_path);
+
+            for (int head_id = 0; head_id < n; ++head_id) {
+                int degree;
+                if (!ifs.read((char*)&degree, sizeof(int)))
+                    throw runtime_error("graph has fewer rows than n");
+                // a row holds distinct neighbors
+                if (degree < 0 || degree > n)
+                    throw runtime_error("degree not matched");
+                auto& neighbors = adjacency[head_id];
+                neighbors.resize(degree);
+                if (!ifs.read((char*)neighbors.data(), degree * sizeof(int)))
+                    throw runtime_error("graph has fewer rows than n");
+                for (const auto id : neighbors) {
+                    if (id < 0 || id >= n)
+                        throw runtime_error("neighbor id out of range: " +
+                                            to_string(id));
+                }
+            }
+            entry_point = calc_medoid(dataset, isolated());
+        }
+    };
+}
+
+#endif //NNDESCENT_SEARCH_GRAPH_HPP
@@ -1,12 +1,125 @@
 #include <experimental/filesystem>
 #include <gtest/gtest.h>
 #include <cpputil.hpp>
+#include <kernels.hpp>
 #include <nndescent.hpp>
+#include <search_graph.hpp>
+#include <out_of_core.hpp>
 
 using namespace std;
 using namespace cpputil;
 using namespace nndescent;
 
+template <typename T>
+void test_kernels() {
+    const auto max_level = kernels::detect_simd_level();
+    for (const auto level : {kernels::SimdLevel::scalar,
+                             kernels::SimdLevel::avx2,
+                             kernels::SimdLevel::avx512}) {
+        if (level > max_level) continue;
+        const auto simd = kernels::make_kernels<T>(level);
+
+        for (int dim = 1; dim <= 200; ++dim) {
+            vector<T> x(dim), y(dim);
+            for (int i = 0; i < dim; ++i) {
+                x[i] = T(static_cast<float>(i % 50));
+                y[i] = T(static_cast<float>((dim - i) % 40));
+            }
+            const auto l2_sqr = kernels::l2_sqr_scalar(&x[0], &y[0], dim);
+            ASSERT_NEAR(simd.l2_sqr(&x[0], &y[0], dim), l2_sqr, l2_sqr * 1e-5);
+            const auto ip = kernels::inner_product_scalar(&x[0], &y[0], dim);
+            ASSERT_NEAR(simd.inner_product(&x[0], &y[0], dim), ip, ip * 1e-5);
+            const auto l1 = kernels::l1_scalar(&x[0], &y[0], dim);
+            ASSERT_NEAR(simd.l1(&x[0], &y[0], dim), l1, l1 * 1e-5);
+
+            // batches of 7 rows cover the two-row passes and the rest
+            vector<vector<T>> rows(7, vector<T>(dim));
+            vector<const T*> ys;
+            for (int j = 0; j < rows.size(); ++j) {
+                for (int i = 0; i < dim; ++i) {
+                    rows[j][i] = T(static_cast<float>((i * (j + 1)) % 30) * 0.37f);
+                }
+                ys.emplace_back(&rows[j][0]);
+            }
+            // bit-identical to the single row kernel of the same level
+            vector<float> dists(ys.size());
+            for (const auto& [batch, distance] : {
+                    make_pair(simd.l2_sqr_batch, simd.l2_sqr),
+                    make_pair(simd.inner_product_batch, simd.inner_product),
+                    make_pair(simd.l1_batch, simd.l1)}) {
+                batch(&x[0], ys.data(), ys.size(), dim, &dists[0]);
+                for (int j = 0; j < ys.size(); ++j) {
+                    ASSERT_EQ(dists[j], distance(&x[0], ys[j], dim));
+                }
+            }
+        }
+    }
+}
+
+TEST(kernels, distance) {
+    test_kernels<float>();
+    test_kernels<float16>();
+    test_kernels<bfloat16>();
+    test_kernels<int8_t>();
+    test_kernels<uint8_t>();
+}
+
+TEST(kernels, half) {
+    for (const float value : {0.0f, 1.0f, -2.5f, 65504.0f, 6.1035156e-05f,
+                              5.9604645e-08f, 0.333251953125f}) {
+        ASSERT_EQ(static_cast<float>(float16(value)), value);
+    }
+    ASSERT_EQ(static_cast<float>(bfloat16(1.5f)), 1.5f);
+    ASSERT_TRUE(isinf(static_cast<float>(float16(1e6f))));
+}
+
+TEST(data_array, load) {
+    string data_path = "/mnt/qnap/data/sift/sift_base.fvecs";
+
+    int n = 100, dim = 128;
+    auto mapped = DataArray(n, dim);
+    mapped.load(data_path);
+
+    auto streamed = DataArray(n, dim);
+    streamed.use_mmap = false;
+    streamed.load(data_path);
+
+    const char* fbin_path = "/tmp/sift100.fbin";
+    {
+        ofstream ofs(fbin_path, ios::binary);
+        const uint32_t header[2] = {static_cast<uint32_t>(n),
+                                    static_cast<uint32_t>(dim)};
+        ofs.write((char*)header, sizeof(header));
+        ofs.write((char*)streamed.data(), n * dim * sizeof(float));
+    }
+    auto fbin = DataArray(n, dim);
+    fbin.load(fbin_path);
+
+    for (int i = 0; i < n * dim; ++i) {
+        ASSERT_EQ(mapped[i], streamed[i]);
+        ASSERT_EQ(fbin[i], streamed[i]);
+    }
+
+    remove(fbin_path);
+}
+
+TEST(data_array, write) {
+    int n = 10, dim = 4;
+    auto data = DataArray(n, dim);
+    ASSERT_EQ(data[1], 0);
+    data.find(3)[2] = 1.5;
+    data[0] = 2;
+    ASSERT_EQ(data[3 * dim + 2], 1.5);
+    ASSERT_EQ(data.find(0)[0], 2);
+
+    // appends keep the written rows
+    data.append(vector<float>(dim, 3).data(), 1);
+    ASSERT_EQ(data.n, n + 1);
+    ASSERT_EQ(data.find(3)[2], 1.5);
+    ASSERT_EQ(data.find(n)[0], 3);
+    ASSERT_THROW(data.load(vector<float>(n * dim - 1)), runtime_error);
+}
+
 TEST(aknng, build) {
     string data_path = "/mnt/qnap/data/sift/sift_base.fvecs";
 
@@ -17,8 +130,544 @@ TEST(aknng, build) {
     int test_id = 0;
     const auto& neighbors = aknng.edgeset[test_id];
     ASSERT_EQ(neighbors.size(), K);
-    ASSERT_EQ(neighbors.cbegin()->second, 2);
-    ASSERT_EQ((--neighbors.cend())->second, 6);
+    ASSERT_EQ(neighbors.front().id, 2);
+    ASSERT_EQ(neighbors.back().id, 6);
+}
+
+// mean recall of every list against brute force
+template <typename Graph>
+float graph_recall(Graph& aknng) {
+    float recall = 0;
+    for (int i = 0; i < aknng.n; ++i) {
+        Neighbors actual, expect;
+        for (const auto& neighbor : aknng.edgeset[i]) {
+            actual.emplace_back(neighbor.dist, neighbor.id);
+        }
+        for (int id = 0; id < aknng.n; ++id) {
+            if (id == i) continue;
+            expect.emplace_back(aknng.calc_dist(aknng.dataset.find(i),
+                                                aknng.dataset.find(id)), id);
+        }
+        sort_neighbors(expect);
+        recall += calc_recall(actual, expect, aknng.K);
+    }
+    return recall / aknng.n;
+}
+
+// recall against brute force, join distance evaluations and iterations of
+// a build over the first n sift rows
+struct BuildResult {
+    float recall;
+    long long n_distances;
+    int n_iterations;
+};
+
+template <typename T = float>
+BuildResult build_sift(int n, int K, BuildParams params) {
+    params.verbose = false;
+    auto aknng = AKNNG<metric::L2, T>(n, 128, K);
+    aknng.build("/mnt/qnap/data/sift/sift_base.fvecs", params);
+    long long n_distances = 0;
+    for (const auto& stats : aknng.iteration_stats) n_distances += stats.n_distances;
+    return {graph_recall(aknng), n_distances, aknng.n_iterations};
+}
+
+TEST(aknng, build_symmetric) {
+    // each pair is evaluated once instead of once from each side
+    int n = 2000, K = 20;
+    for (const auto init_mode : {InitMode::random, InitMode::rp_forest}) {
+        BuildParams params;
+        params.init_mode = init_mode;
+        const auto pull = build_sift(n, K, params);
+        params.join_mode = JoinMode::symmetric;
+        const auto symmetric = build_sift(n, K, params);
+        ASSERT_LE(symmetric.n_distances, 0.65 * pull.n_distances);
+        ASSERT_GE(symmetric.recall, pull.recall - 0.01);
+    }
+}
+
+TEST(aknng, build_rp_forest) {
+    // the forest start converges to the same recall as the random start in
+    // fewer iterations with fewer join distances
+    int n = 2000, K = 20;
+    BuildParams params;
+    params.n_trees = 4;
+    params.leaf_size = 32;
+    params.init_mode = InitMode::rp_forest;
+    const auto forest = build_sift(n, K, params);
+    params.init_mode = InitMode::random;
+    const auto random = build_sift(n, K, params);
+    ASSERT_GE(forest.recall, random.recall - 0.01);
+    ASSERT_LT(forest.n_iterations, random.n_iterations);
+    ASSERT_LE(forest.n_distances, 0.5 * random.n_distances);
+}
+
+TEST(aknng, build_cosine) {
+    string data_path = "/mnt/qnap/data/sift/sift_base.fvecs";
+
+    int n = 10, dim = 128, K = 2;
+    auto aknng = AKNNG<metric::Cosine>(n, dim, K);
+    aknng.build(data_path);
+
+    // rows are normalized, and the nearest neighbor maximizes the cosine
+    int test_id = 0, nearest_id = -1;
+    float max_similarity = -1;
+    for (int id = 1; id < n; ++id) {
+        const auto similarity = inner_product(
+                aknng.dataset.find(test_id), aknng.dataset.find(test_id) + dim,
+                aknng.dataset.find(id), 0.0f);
+        if (similarity <= max_similarity) continue;
+        max_similarity = similarity;
+        nearest_id = id;
+    }
+
+    ASSERT_NEAR(l2_norm(Data<>(vector<float>(
+            aknng.dataset.find(test_id), aknng.dataset.find(test_id) + dim))),
+                1, 1e-5);
+    ASSERT_EQ(aknng.edgeset[test_id].front().id, nearest_id);
+    ASSERT_NEAR(aknng.edgeset[test_id].front().dist, 1 - max_similarity, 1e-5);
+}
+
+TEST(aknng, build_uint8) {
+    string data_path = "/mnt/qnap/data/sift/sift_base.fvecs";
+
+    // uint8 rows are the float rows converted, which sift values, integers
+    // in [0, 255], survive exactly
+    int n = 500, dim = 128, K = 10;
+    auto rows = DataArray<uint8_t>(n, dim);
+    rows.load(data_path);
+    auto expect = DataArray(n, dim);
+    expect.load(data_path);
+    for (size_t i = 0; i < rows.size(); ++i) {
+        ASSERT_EQ(rows[i], element_cast<uint8_t>(expect[i]));
+    }
+
+    // and the graph is as good as the float graph
+    ASSERT_GE(build_sift<uint8_t>(n, K, {}).recall, build_sift(n, K, {}).recall - 0.01);
+}
+
+TEST(aknng, build_reproducible) {
+    string data_path = "/mnt/qnap/data/sift/sift_base.fvecs";
+
+    int n = 1000, dim = 128, K = 10, seed = 7;
+    BuildParams params;
+    params.init_mode = InitMode::rp_forest;
+
+    const auto n_threads = omp_get_max_threads();
+    omp_set_num_threads(1);
+    auto aknng_1 = AKNNG(n, dim, K, seed);
+    aknng_1.build(data_path, params);
+
+    omp_set_num_threads(4);
+    auto aknng_4 = AKNNG(n, dim, K, seed);
+    aknng_4.build(data_path, params);
+    omp_set_num_threads(n_threads);
+
+    ASSERT_EQ(aknng_1.n_iterations, aknng_4.n_iterations);
+    for (int id = 0; id < n; ++id) {
+        ASSERT_EQ(aknng_1.edgeset[id].size(), aknng_4.edgeset[id].size());
+        for (int i = 0; i < aknng_1.edgeset[id].size(); ++i) {
+            ASSERT_EQ(aknng_1.edgeset[id][i].id, aknng_4.edgeset[id][i].id);
+        }
+    }
+}
+
+TEST(aknng, build_max_iterations) {
+    string data_path = "/mnt/qnap/data/sift/sift_base.fvecs";
+
+    int n = 1000, dim = 128, K = 10;
+    auto aknng = AKNNG(n, dim, K);
+    BuildParams params;
+    params.delta = 0;
+    params.max_iterations = 1;
+    aknng.build(data_path, params);
+
+    ASSERT_EQ(aknng.n_iterations, 1);
+    ASSERT_EQ(aknng.stop_reason, StopReason::max_iterations);
+}
+
+TEST(aknng, search) {
+    string data_path = "/mnt/qnap/data/sift/sift_base.fvecs";
+
+    int n = 1000, dim = 128, K = 10;
+    auto aknng = AKNNG(n, dim, K);
+    aknng.build(data_path);
+    aknng.init_entry_points(EntryMode::medoid, 64);
+
+    // dataset rows as queries: each row is its own nearest neighbor
+    const auto result = aknng.search(aknng.dataset.find(5), 3, 16);
+    ASSERT_EQ(result.size(), 3);
+    ASSERT_EQ(result[0].id, 5);
+    ASSERT_EQ(result[0].dist, 0);
+    ASSERT_LE(result[1].dist, result[2].dist);
+
+    int k = 10, n_queries = 100;
+    auto queries = DataArray(n_queries, dim);
+    queries.load(vector<float>(aknng.dataset.find(0),
+                               aknng.dataset.find(n_queries)));
+    const auto results = aknng.search(queries, k, 32);
+    ASSERT_EQ(results.size(), n_queries);
+
+    float recall = 0;
+    for (int i = 0; i < n_queries; ++i) {
+        Neighbors expect;
+        for (int id = 0; id < n; ++id) {
+            expect.emplace_back(aknng.calc_dist(queries.find(i),
+                                                aknng.dataset.find(id)), id);
+        }
+        sort_neighbors(expect);
+        recall += calc_recall(results[i], expect, k);
+    }
+    ASSERT_GE(recall / n_queries, 0.9);
+}
+
+TEST(aknng, insert) {
+    string data_path = "/mnt/qnap/data/sift/sift_base.fvecs";
+
+    int n = 1000, dim = 128, K = 10, n_base = 600;
+    auto full = DataArray(n, dim);
+    full.load(data_path);
+
+    auto aknng = AKNNG(n_base, dim, K);
+    aknng.build(data_path);
+    aknng.init_entry_points(EntryMode::medoid, 64);
+    auto batch = DataArray(n - n_base, dim);
+    batch.load(vector<float>(full.find(n_base), full.find(n)));
+    ASSERT_EQ(aknng.insert(batch), n_base);
+    ASSERT_EQ(aknng.n, n);
+    ASSERT_EQ(aknng.dataset.n, n);
+
+    float recall = 0;
+    for (int i = 0; i < n; ++i) {
+        ASSERT_EQ(aknng.edgeset[i].size(), K);
+        Neighbors actual, expect;
+        for (const auto& neighbor : aknng.edgeset[i]) {
+            actual.emplace_back(neighbor.dist, neighbor.id);
+        }
+        for (int id = 0; id < n; ++id) {
+            if (id == i) continue;
+            expect.emplace_back(aknng.calc_dist(full.find(i), full.find(id)), id);
+        }
+        sort_neighbors(expect);
+        recall += calc_recall(actual, expect, K);
+    }
+    ASSERT_GE(recall / n, 0.9);
+}
+
+TEST(aknng, remove) {
+    string data_path = "/mnt/qnap/data/sift/sift_base.fvecs";
+
+    int n = 1000, dim = 128, K = 10;
+    auto aknng = AKNNG(n, dim, K);
+    aknng.build(data_path);
+    aknng.init_entry_points(EntryMode::medoid, 64);
+
+    for (int id = 0; id < 100; ++id) ASSERT_TRUE(aknng.remove(id));
+    ASSERT_FALSE(aknng.remove(0));
+    for (const auto& neighbor : aknng.search(aknng.dataset.find(5), 10, 32)) {
+        ASSERT_GE(neighbor.id, 100);
+    }
+
+    // below compact_ratio: lists are repaired in place
+    ASSERT_TRUE(aknng.repair().empty());
+    for (int id = 100; id < n; ++id) {
+        ASSERT_EQ(aknng.edgeset[id].size(), K);
+        for (const auto& neighbor : aknng.edgeset[id]) {
+            ASSERT_GE(neighbor.id, 100);
+        }
+    }
+
+    const vector<float> row(aknng.dataset.find(300), aknng.dataset.find(301));
+    for (int id = 100; id < 250; ++id) aknng.remove(id);
+    const auto id_map = aknng.repair();
+    ASSERT_EQ(id_map.size(), n);
+    ASSERT_EQ(id_map[249], -1);
+    ASSERT_EQ(id_map[300], 50);
+    ASSERT_EQ(aknng.n, n - 250);
+    ASSERT_EQ(aknng.n_removed, 0);
+    ASSERT_EQ(vector<float>(aknng.dataset.find(50), aknng.dataset.find(51)), row);
+    for (int id = 0; id < aknng.n; ++id) {
+        for (const auto& neighbor : aknng.edgeset[id]) {
+            ASSERT_LT(neighbor.id, aknng.n);
+        }
+    }
+}
+
+TEST(aknng, build_sharded) {
+    string data_path = "/mnt/qnap/data/sift/sift_base.fvecs";
+    string work_dir = "/tmp";
+
+    int n = 1000, dim = 128, K = 10, n_shards = 3;
+    // the children are forked after the thread pool of this process started
+    const auto n_threads = omp_get_max_threads();
+    omp_set_num_threads(4);
+    int n_started = 0;
+#pragma omp parallel reduction(+:n_started)
+    ++n_started;
+    ASSERT_EQ(n_started, 4);
+    BuildParams params;
+    params.checkpoint_path = work_dir + "/sharded.checkpoint";
+    params.stats_path = work_dir + "/sharded.jsonl";
+    for (int shard_i = 0; shard_i < n_shards; ++shard_i) {
+        remove((params.checkpoint_path + ".shard_" + to_string(shard_i)).c_str());
+        remove((params.stats_path + ".shard_" + to_string(shard_i)).c_str());
+    }
+    // a failed child of this process that the build must leave alone
+    const auto other_pid = fork();
+    if (other_pid == 0) _exit(3);
+    auto merged = build_sharded(data_path, n, dim, K, n_shards, work_dir, params);
+    omp_set_num_threads(n_threads);
+    int other_status = 0;
+    ASSERT_EQ(waitpid(other_pid, &other_status, 0), other_pid);
+    ASSERT_EQ(WEXITSTATUS(other_status), 3);
+    ASSERT_EQ(merged.n, n);
+
+    // every shard wrote its own checkpoint and stats
+    for (int shard_i = 0; shard_i < n_shards; ++shard_i) {
+        const auto suffix = ".shard_" + to_string(shard_i);
+        ASSERT_TRUE(ifstream(params.stats_path + suffix).good());
+        AKNNG shard(n * (shard_i + 1) / n_shards - n * shard_i / n_shards, dim, K);
+        shard.dataset.offset = n * shard_i / n_shards;
+        shard.load_checkpoint(params.checkpoint_path + suffix);
+        ASSERT_EQ(shard.dataset.offset, n * shard_i / n_shards);
+    }
+
+    float recall = 0;
+    for (int i = 0; i < n; ++i) {
+        ASSERT_EQ(merged.edgeset[i].size(), K);
+        Neighbors actual, expect;
+        for (const auto& neighbor : merged.edgeset[i]) {
+            actual.emplace_back(neighbor.dist, neighbor.id);
+        }
+        for (int id = 0; id < n; ++id) {
+            if (id == i) continue;
+            expect.emplace_back(merged.calc_dist(merged.dataset.find(i),
+                                                 merged.dataset.find(id)), id);
+        }
+        sort_neighbors(expect);
+        recall += calc_recall(actual, expect, K);
+    }
+    ASSERT_GE(recall / n, 0.9);
+}
+
+TEST(aknng, build_out_of_core) {
+    string data_path = "/mnt/qnap/data/sift/sift_base.fvecs";
+
+    int n = 1000, dim = 128, K = 10;
+    auto aknng = OutOfCoreAKNNG(n, dim, K);
+    OutOfCoreParams params;
+    params.memory_budget = 300 * aknng.bytes_per_row();
+    params.build_params.checkpoint_path = "/tmp/out_of_core.checkpoint";
+    params.build_params.stats_path = "/tmp/out_of_core.jsonl";
+    aknng.build(data_path, params);
+    ASSERT_EQ(aknng.n_blocks, 4);
+    // two rounds of two partners per block cover all six pairs
+    ASSERT_EQ(aknng.n_merges, 6);
+    // every block writes its own checkpoint and stats
+    for (int block_i = 0; block_i < aknng.n_blocks; ++block_i) {
+        const auto suffix = ".block_" + to_string(block_i);
+        ASSERT_TRUE(ifstream(params.build_params.checkpoint_path + suffix).good());
+        ASSERT_TRUE(ifstream(params.build_params.stats_path + suffix).good());
+    }
+
+    // every build has its own block directory, removed with the graph
+    string other_dir;
+    {
+        auto other = OutOfCoreAKNNG(n, dim, K);
+        params.build_params.verbose = false;
+        other.build(data_path, params);
+        other_dir = other.work_dir;
+        ASSERT_NE(other_dir, aknng.work_dir);
+    }
+    struct stat st;
+    ASSERT_NE(stat(other_dir.c_str(), &st), 0);
+
+    auto dataset = DataArray(n, dim);
+    dataset.load(data_path);
+    float recall = 0;
+    aknng.for_each_list([&](int head_id, const EdgeRow& row) {
+        ASSERT_EQ(row.size(), K);
+        Neighbors actual, expect;
+        for (const auto& neighbor : row) actual.emplace_back(neighbor.dist, neighbor.id);
+        for (int id = 0; id < n; ++id) {
+            if (id == head_id) continue;
+            expect.emplace_back(metric::L2::distance(dataset.find(head_id),
+                                                     dataset.find(id), dim), id);
+        }
+        sort_neighbors(expect);
+        recall += calc_recall(actual, expect, K);
+    });
+    ASSERT_GE(recall / n, 0.9);
+
+    // rows of the .ivecs file hold the degree and the real ids only
+    aknng.save("/tmp/out_of_core.ivecs");
+    ifstream ifs("/tmp/out_of_core.ivecs", ios::binary);
+    int head_id = 0;
+    aknng.for_each_list([&](int id, const EdgeRow& row) {
+        int degree = -1;
+        ifs.read((char*)&degree, sizeof(int));
+        ASSERT_EQ(degree, row.size());
+        vector<int> ids(degree);
+        ifs.read((char*)ids.data(), degree * sizeof(int));
+        for (int i = 0; i < degree; ++i) ASSERT_EQ(ids[i], row[i].id);
+        ASSERT_EQ(id, head_id++);
+    });
+    ASSERT_TRUE(ifs.good());
+    ASSERT_EQ(ifs.peek(), EOF);
+}
+
+// peak resident bytes since the last reset
+size_t peak_rss(bool reset = false) {
+    if (reset) ofstream("/proc/self/clear_refs") << "5";
+    ifstream ifs("/proc/self/status");
+    string line;
+    while (getline(ifs, line)) {
+        if (line.rfind("VmHWM:", 0) == 0) return stoull(line.substr(6)) * 1024;
+    }
+    return 0;
+}
+
+TEST(aknng, build_out_of_core_memory) {
+    string data_path = "/mnt/qnap/data/sift/sift_base.fvecs";
+
+    int n = 5000, dim = 128, K = 10;
+    auto aknng = OutOfCoreAKNNG(n, dim, K);
+    OutOfCoreParams params;
+    params.memory_budget = n / 4 * aknng.bytes_per_row();
+    params.build_params.verbose = false;
+
+    const auto before = peak_rss(true);
+    aknng.build(data_path, params);
+    const auto peak = peak_rss() - before;
+    ASSERT_EQ(aknng.n_blocks, 4);
+    ASSERT_LE(peak, params.memory_budget);
+}
+
+TEST(aknng, build_out_of_core_schedule) {
+    string data_path = "/mnt/qnap/data/sift/sift_base.fvecs";
+
+    // the merges of a build grow linearly with the blocks, where all pairs
+    // would take 120 and 496 merges
+    int n = 1920, dim = 128, K = 10;
+    vector<size_t> n_merges;
+    for (const int n_blocks : {16, 32}) {
+        auto aknng = OutOfCoreAKNNG(n, dim, K);
+        OutOfCoreParams params;
+        params.memory_budget = n / n_blocks * aknng.bytes_per_row();
+        params.build_params.verbose = false;
+        aknng.build(data_path, params);
+        ASSERT_EQ(aknng.n_blocks, n_blocks);
+        ASSERT_LE(aknng.n_merges, params.max_rounds * n_blocks * params.merge_fanout / 2);
+        n_merges.emplace_back(aknng.n_merges);
+
+        aknng.for_each_list([&](int head_id, const EdgeRow& row) {
+            ASSERT_EQ(row.size(), K);
+            for (int i = 1; i < K; ++i) ASSERT_LE(row[i - 1].dist, row[i].dist);
+        });
+    }
+    ASSERT_LE(n_merges[1], 2.5 * n_merges[0]);
+}
+
+TEST(aknng, resume) {
+    string data_path = "/mnt/qnap/data/sift/sift_base.fvecs";
+    string checkpoint_path = "/tmp/aknng_test.ckpt";
+
+    int n = 1000, dim = 128, K = 10;
+    auto expect = AKNNG(n, dim, K);
+    expect.build(data_path);
+
+    // interrupted after two iterations
+    BuildParams params;
+    params.max_iterations = 2;
+    params.checkpoint_path = checkpoint_path;
+    auto interrupted = AKNNG(n, dim, K);
+    interrupted.build(data_path, params);
+
+    auto resumed = AKNNG(n, dim, K);
+    resumed.resume(checkpoint_path, BuildParams());
+    ASSERT_EQ(resumed.n_iterations, expect.n_iterations);
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < K; ++j) {
+            ASSERT_EQ(resumed.edgeset[i][j].id, expect.edgeset[i][j].id);
+        }
+    }
+
+    // the saved parameters keep a pending reorder and the stats output
+    string stats_path = "/tmp/aknng_test_resume.jsonl";
+    params = BuildParams();
+    params.verbose = false;
+    params.reorder = ReorderMode::bfs;
+    params.reorder_iteration = 3;
+    params.stats_path = stats_path;
+    auto reordered = AKNNG(n, dim, K);
+    reordered.build(data_path, params);
+
+    // the process dies in the third iteration
+    params.checkpoint_path = checkpoint_path;
+    params.on_iteration = [](const IterationStats& stats) {
+        if (stats.iteration == 2) throw runtime_error("killed");
+    };
+    ASSERT_THROW(AKNNG(n, dim, K).build(data_path, params), runtime_error);
+    resumed = AKNNG(n, dim, K);
+    resumed.resume(checkpoint_path);
+    ASSERT_EQ(resumed.n_iterations, reordered.n_iterations);
+    ASSERT_FALSE(resumed.id_map.empty());
+    ASSERT_EQ(resumed.id_map.external_ids, reordered.id_map.external_ids);
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < K; ++j) {
+            ASSERT_EQ(resumed.edgeset[i][j].id, reordered.edgeset[i][j].id);
+        }
+    }
+    ifstream stats(stats_path);
+    string line, last_line;
+    while (getline(stats, line)) last_line = line;
+    ASSERT_EQ(json::parse(last_line)["iteration"], resumed.n_iterations - 1);
+
+    // rows not loaded from a file can't be reloaded on resume
+    auto preloaded = AKNNG(n, dim, K);
+    preloaded.dataset.load(vector<float>(expect.dataset.data(),
+                                         expect.dataset.data() + n * dim));
+    ASSERT_THROW(preloaded.build(params), runtime_error);
+}
+
+TEST(aknng, build_stats) {
+    string data_path = "/mnt/qnap/data/sift/sift_base.fvecs";
+    string stats_path = "/tmp/aknng_test_stats.jsonl";
+
+    int n = 1000, dim = 128, K = 10;
+    BuildParams params;
+    params.verbose = false;
+    params.recall_samples = 50;
+    params.stats_path = stats_path;
+    int n_called = 0;
+    params.on_iteration = [&](const IterationStats& stats) {
+        ASSERT_EQ(stats.iteration, n_called);
+        ++n_called;
+    };
+    auto aknng = AKNNG(n, dim, K);
+    aknng.build(data_path, params);
+
+    ASSERT_EQ(n_called, aknng.n_iterations);
+    ASSERT_EQ(aknng.iteration_stats.size(), aknng.n_iterations);
+    for (const auto& stats : aknng.iteration_stats) {
+        long long n_distances = 0;
+        for (const auto& thread : stats.threads) n_distances += thread.n_distances;
+        ASSERT_EQ(stats.n_distances, n_distances);
+        ASSERT_GE(stats.imbalance, 1);
+    }
+    ASSERT_GT(aknng.iteration_stats[0].n_distances, 0);
+    ASSERT_GT(aknng.iteration_stats.back().recall,
+              aknng.iteration_stats[0].recall);
+    ASSERT_GT(aknng.iteration_stats.back().recall, 0.9);
+
+    ifstream ifs(stats_path);
+    string line;
+    int n_lines = 0;
+    while (getline(ifs, line)) {
+        ASSERT_EQ(json::parse(line)["iteration"], n_lines);
+        ++n_lines;
+    }
+    ASSERT_EQ(n_lines, aknng.n_iterations);
 }
 
 TEST(aknng, save) {
@@ -45,13 +694,13 @@ TEST(aknng, save) {
     );
 
     ASSERT_EQ(
-            aknng.edgeset[0].begin()->second,
-            saved.edgeset[0].begin()->second
+            aknng.edgeset[0].front().id,
+            saved.edgeset[0].front().id
     );
 
     ASSERT_EQ(
-            aknng.edgeset[1].begin()->second,
-            saved.edgeset[1].begin()->second
+            aknng.edgeset[1].front().id,
+            saved.edgeset[1].front().id
     );
 
     remove(save_path);
@@ -81,24 +730,268 @@ TEST(aknng, save_load_binary) {
     );
 
     ASSERT_EQ(
-            aknng.edgeset[0].begin()->second,
-            saved.edgeset[0].begin()->second
+            aknng.edgeset[0].front().id,
+            saved.edgeset[0].front().id
     );
 
     ASSERT_EQ(
-            aknng.edgeset[0].begin()->first,
-            saved.edgeset[0].begin()->first
+            aknng.edgeset[0].front().dist,
+            saved.edgeset[0].front().dist
     );
 
     ASSERT_EQ(
-            aknng.edgeset[1].begin()->second,
-            saved.edgeset[1].begin()->second
+            aknng.edgeset[1].front().id,
+            saved.edgeset[1].front().id
     );
 
     ASSERT_EQ(
-            aknng.edgeset[1].begin()->first,
-            saved.edgeset[1].begin()->first
+            aknng.edgeset[1].front().dist,
+            saved.edgeset[1].front().dist
     );
 
+    // rows with ids out of range or a bad degree are rejected
+    for (const auto& row : {vector<int>{2, 1, -1}, vector<int>{2, 1, n},
+                            vector<int>{-1}, vector<int>{K + 1}}) {
+        {
+            ofstream ofs(save_path, ios::binary);
+            ofs.write((char*)row.data(), row.size() * sizeof(int));
+        }
+        auto corrupt = AKNNG(n, dim, K);
+        ASSERT_THROW(corrupt.load(data_path, save_path), runtime_error);
+        auto graph = SearchGraph(n, dim);
+        ASSERT_THROW(graph.load(data_path, save_path), runtime_error);
+    }
+
     remove(save_path);
 }
+
+TEST(aknng, reorder) {
+    string data_path = "/mnt/qnap/data/sift/sift_base.fvecs";
+    string expect_path = "/tmp/aknng_test_expect.ivecs";
+    string reordered_path = "/tmp/aknng_test_reordered.ivecs";
+
+    int n = 1000, dim = 128, K = 10;
+    auto expect = AKNNG(n, dim, K);
+    expect.build(data_path);
+    expect.save(expect_path);
+
+    // mean id distance of the edges
+    const auto edge_span = [&](AKNNG<>& aknng) {
+        double total = 0;
+        for (int id = 0; id < n; ++id) {
+            for (const auto& neighbor : aknng.edgeset[id]) total += abs(id - neighbor.id);
+        }
+        return total / (n * K);
+    };
+
+    for (const auto mode : {ReorderMode::bfs, ReorderMode::rcm, ReorderMode::gorder}) {
+        auto aknng = AKNNG(n, dim, K);
+        aknng.build(data_path);
+        aknng.reorder(mode);
+        ASSERT_LT(edge_span(aknng), edge_span(expect));
+
+        for (int id = 0; id < n; ++id) {
+            const auto external_id = aknng.id_map.external(id);
+            ASSERT_EQ(aknng.id_map.internal(external_id), id);
+            ASSERT_TRUE(equal(aknng.dataset.find(id), aknng.dataset.find(id) + dim,
+                              expect.dataset.find(external_id)));
+        }
+
+        // saved and searched in input order ids
+        aknng.save(reordered_path);
+        ifstream expect_file(expect_path, ios::binary), reordered_file(reordered_path, ios::binary);
+        ASSERT_TRUE(equal(istreambuf_iterator<char>(expect_file), istreambuf_iterator<char>(),
+                          istreambuf_iterator<char>(reordered_file)));
+        for (int i = 0; i < 10; ++i) {
+            const auto result = aknng.search(expect.dataset.find(i), 10, 32);
+            const auto expect_result = expect.search(expect.dataset.find(i), 10, 32);
+            for (int j = 0; j < expect_result.size(); ++j) {
+                ASSERT_EQ(result[j].id, expect_result[j].id);
+            }
+        }
+    }
+
+    // mid-build
+    BuildParams params;
+    params.reorder = ReorderMode::rcm;
+    params.recall_samples = 50;
+    auto aknng = AKNNG(n, dim, K);
+    aknng.build(data_path, params);
+    ASSERT_FALSE(aknng.id_map.empty());
+    ASSERT_GT(aknng.iteration_stats.back().recall, 0.9);
+}
+
+TEST(search_graph, build) {
+    string data_path = "/mnt/qnap/data/sift/sift_base.fvecs";
+    string save_path = "/tmp/search_graph_test.ivecs";
+
+    int n = 1000, dim = 128, K = 20;
+    auto aknng = AKNNG(n, dim, K);
+    aknng.build(data_path);
+
+    PruneParams params;
+    params.max_degree = 16;
+    auto graph = SearchGraph(n, dim);
+    graph.build(aknng, params);
+    ASSERT_LT(graph.n_edges(), size_t(n) * K);
+
+    // every node is reachable from the entry point
+    vector<char> reached(n, false);
+    graph.mark_reachable(graph.entry_point, reached);
+    ASSERT_EQ(count(reached.begin(), reached.end(), true), n);
+
+    // neighbors stay sorted by distance after the reachability links
+    for (int head_id = 0; head_id < n; ++head_id) {
+        const auto& neighbors = graph.adjacency[head_id];
+        for (int i = 1; i < neighbors.size(); ++i) {
+            ASSERT_LE(graph.calc_dist(head_id, neighbors[i - 1]),
+                      graph.calc_dist(head_id, neighbors[i]));
+        }
+    }
+
+    int k = 10, n_queries = 100;
+    float recall = 0;
+    for (int i = 0; i < n_queries; ++i) {
+        const auto result = graph.search(graph.dataset.find(i), k, 32);
+        Neighbors expect;
+        for (int id = 0; id < n; ++id) {
+            expect.emplace_back(graph.calc_dist(i, id), id);
+        }
+        sort_neighbors(expect);
+        recall += calc_recall(result, expect, k);
+    }
+    ASSERT_GE(recall / n_queries, 0.9);
+
+    for (const auto path : {save_path, string("/tmp/search_graph_test.graph")}) {
+        graph.save(path);
+        auto loaded = SearchGraph(n, dim);
+        loaded.load(data_path, path);
+        ASSERT_EQ(loaded.adjacency, graph.adjacency);
+        ASSERT_EQ(loaded.entry_point, graph.entry_point);
+    }
+
+    // removed nodes keep no edges and the live ones stay reachable
+    for (int id = 0; id < n; id += 10) aknng.remove(id);
+    auto live = SearchGraph(n, dim);
+    live.build(aknng, params);
+    reached.assign(n, false);
+    live.mark_reachable(live.entry_point, reached);
+    for (int id = 0; id < n; ++id) {
+        ASSERT_EQ(reached[id], id % 10 != 0);
+        if (id % 10 == 0) ASSERT_TRUE(live.adjacency[id].empty());
+    }
+    live.save(save_path);
+    auto loaded = SearchGraph(n, dim);
+    loaded.load(data_path, save_path);
+    ASSERT_EQ(loaded.entry_point, live.entry_point);
+
+    auto other_n = SearchGraph(n - 1, dim);
+    ASSERT_THROW(other_n.build(aknng, params), runtime_error);
+}
+
+TEST(aknng, save_load_graph) {
+    string data_path = "/mnt/qnap/data/sift/sift_base.fvecs";
+    string save_path = "/tmp/aknng_test.graph";
+
+    int n = 1000, dim = 128, K = 10;
+    auto aknng = AKNNG(n, dim, K);
+    aknng.build(data_path);
+    // a short row
+    aknng.edgeset.degree[3] = 4;
+    aknng.save(save_path);
+
+    auto saved = AKNNG(n, dim, K);
+    saved.load(data_path, save_path);
+    ASSERT_NE(saved.edgeset.mapped, nullptr);
+    for (int i = 0; i < n; ++i) {
+        ASSERT_EQ(saved.edgeset[i].size(), aknng.edgeset[i].size());
+        for (int j = 0; j < aknng.edgeset[i].size(); ++j) {
+            ASSERT_EQ(saved.edgeset[i][j].id, aknng.edgeset[i][j].id);
+            ASSERT_EQ(saved.edgeset[i][j].dist, aknng.edgeset[i][j].dist);
+        }
+    }
+
+    // a copy owns its rows, so writes to it leave the mapped lists alone
+    auto copied = saved.edgeset;
+    ASSERT_EQ(copied.mapped, nullptr);
+    copied.insert(0, 0.0f, n - 1);
+    ASSERT_EQ(copied[0][0].id, n - 1);
+    ASSERT_EQ(saved.edgeset[0][0].id, aknng.edgeset[0][0].id);
+    auto rows = saved.dataset;
+    ASSERT_EQ(rows.mapped, nullptr);
+    rows[0] += 1;
+    ASSERT_EQ(saved.dataset[0] + 1, rows[0]);
+
+    auto other_k = AKNNG(n, dim, K + 1);
+    ASSERT_THROW(other_k.load(data_path, save_path), runtime_error);
+
+    // flip one payload byte
+    {
+        fstream fs(save_path, ios::binary | ios::in | ios::out);
+        fs.seekp(sizeof(GraphHeader) + 5);
+        fs.put(0x7f);
+    }
+    auto corrupted = AKNNG(n, dim, K);
+    ASSERT_THROW(corrupted.load(data_path, save_path), runtime_error);
+}
+
+TEST(aknng, save_load_csv) {
+    string data_path = "/mnt/qnap/data/sift/sift_base.fvecs";
+    string save_path = "/tmp/aknng_test.csv";
+    string save_dir = "/tmp/aknng_test_dir/";
+    mkdir(save_dir.c_str(), 0755);
+
+    int n = 2500, dim = 128, K = 10;
+    auto aknng = AKNNG(n, dim, K);
+    aknng.build(data_path);
+    aknng.save(save_path);
+    aknng.save(save_dir);
+
+    auto saved = AKNNG(n, dim, K);
+    saved.load(data_path, save_path);
+    for (int i = 0; i < n; ++i) {
+        ASSERT_EQ(saved.edgeset[i].size(), K);
+        for (int j = 0; j < K; ++j) {
+            ASSERT_EQ(saved.edgeset[i][j].id, aknng.edgeset[i][j].id);
+            ASSERT_FLOAT_EQ(saved.edgeset[i][j].dist, aknng.edgeset[i][j].dist);
+        }
+    }
+
+    // the directory holds the same lines split every 1000 nodes
+    const auto lines = read_csv(save_path);
+    ASSERT_EQ(lines.size(), n * K);
+    ASSERT_EQ(lines[K * 1000].id, K * 1000);
+    ASSERT_EQ(lines[K * 1000][0], 1000);
+    const auto dir_lines = read_csv(save_dir + "1.csv");
+    ASSERT_EQ(dir_lines.size(), 1000 * K);
+    ASSERT_EQ(dir_lines[0].x, lines[K * 1000].x);
+}
+
+TEST(cpputil, read_csv) {
+    const string path = "/tmp/cpputil_test.csv";
+    {
+        ofstream ofs(path);
+        ofs << "x,y\n1.5,2\n-3e2, 4\r\n5,6";
+    }
+    const auto rows = read_csv(path, -1, true);
+    ASSERT_EQ(rows.size(), 3);
+    ASSERT_EQ(rows[0].id, 1);
+    ASSERT_EQ(rows[1].x, vector<float>({-300, 4}));
+    ASSERT_EQ(rows[2].x, vector<float>({5, 6}));
+    ASSERT_EQ(read_csv(path, 2, true).size(), 1);
+    ASSERT_THROW(read_csv(path), runtime_error);
+}
+
+TEST(cpputil, load_data) {
+    const string dir = "/tmp/cpputil_test_dir";
+    mkdir(dir.c_str(), 0755);
+    {
+        ofstream ofs(dir + "/0.csv");
+        ofs << "0,1.5,2\r\n\n1,3,4\r\n";
+    }
+    const auto series = load_data(dir, 1);
+    ASSERT_EQ(series[0].x, vector<float>({1.5, 2}));
+    ASSERT_EQ(series[1].id, 1);
+    ASSERT_EQ(series[1].x, vector<float>({3, 4}));
+    ASSERT_THROW(load_data(dir, 2), runtime_error);
+}